@@ -24,11 +24,15 @@
 #define isnan _isnan
 #define inline __inline
 #define random rand
+#define srandom srand
 #define ATTRIBUTE_UNUSED
 #endif /* WIN32 */
 
 /* HAVE_GLUT defined if we're building a standalone glsnake,
  * and not defined if we're building as an xscreensaver hack */
+/* ask for the prototypes of GL entry points newer than 1.1 */
+#define GL_GLEXT_PROTOTYPES
+
 #ifdef HAVE_GLUT
 #include <GL/glut.h>
 #else
@@ -36,17 +40,49 @@
 #include <GL/glu.h>
 #endif
 
+#include <ctype.h>
+#include <errno.h>
 #include <float.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef PROFILE
+#include <signal.h>
+#endif
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-/* angles */
-#define ZERO 0.0
-#define LEFT 90.0
-#define PIN 180.0
-#define RIGHT 270.0
+/* angles, in quarter turns */
+#define ZERO 0
+#define LEFT 1
+#define PIN 2
+#define RIGHT 3
+
+/* Joint angles of the displayed snake are fixed point: the integer part
+ * counts quarter turns and the low ANGLE_SHIFT bits hold the progress
+ * through the current quarter turn.  A full turn wraps with ANGLE_MASK. */
+#define ANGLE_SHIFT 16
+#define ANGLE_ONE (1 << ANGLE_SHIFT)
+#define ANGLE_HALF (2 * ANGLE_ONE)
+#define ANGLE_FULL (4 * ANGLE_ONE)
+#define ANGLE_MASK (ANGLE_FULL - 1)
+#define ANGLE_TO_DEGREES(a) ((float)(a) * (90.0f / ANGLE_ONE))
 
 #ifdef HAVE_GETTIMEOFDAY
 #ifdef GETTIMEOFDAY_TWO_ARGS
@@ -101,6 +137,17 @@ typedef struct timeb snaketime;
 #define DEF_ZOOM 25.0
 #define DEF_WIREFRAME 0
 #define DEF_TRANSPARENT 1
+#define DEF_SNAKES 1
+#define DEF_OCCLUSION 0
+#define DEF_SHADERS 0
+#define DEF_TRANSPARENCY 1
+#define DEF_SOFTWARE 0
+#define DEF_MAXFPS 0
+#define DEF_HUD 0
+#define DEF_EXPORT_SIZE "640x480"
+#define DEF_EXPORT_FRAMES 300
+#define DEF_SHEET_GRID "8x8"
+#define DEF_THUMB_SIZE "160x160"
 #else
 /* xscreensaver options doobies prefer strings */
 #define DEF_YANGVEL "0.10"
@@ -114,6 +161,13 @@ typedef struct timeb snaketime;
 #define DEF_ZOOM "25.0"
 #define DEF_WIREFRAME "False"
 #define DEF_TRANSPARENT "True"
+#define DEF_SNAKES "1"
+#define DEF_OCCLUSION "False"
+#define DEF_SHADERS "False"
+#define DEF_TRANSPARENCY "1"
+#define DEF_SOFTWARE "False"
+#define DEF_MAXFPS "0"
+#define DEF_HUD "False"
 #endif
 
 /* static variables */
@@ -126,8 +180,9 @@ typedef struct timeb snaketime;
 
 static GLfloat explode;
 static long statictime;
-static GLfloat yspin = 60.0;
-static GLfloat zspin = -45.0;
+/* kept in double, as they add up small steps for as long as glsnake runs */
+static double yspin = 60.0;
+static double zspin = -45.0;
 static GLfloat yangvel;
 static GLfloat zangvel;
 static Bool altcolour;
@@ -137,6 +192,19 @@ static Bool wireframe;
 static Bool transparent;
 static GLfloat zoom;
 static GLfloat angvel;
+static int snakes;
+static Bool benchmark;
+static Bool occlusion;
+static Bool shaders;
+static int transparency;
+static Bool software;
+static int maxfps;
+static Bool hud;
+
+/* ways of blending transparent snakes */
+#define TRANSPARENCY_CHAIN 0    /* node by node along the chain */
+#define TRANSPARENCY_SORTED 1   /* nodes sorted far to near */
+#define TRANSPARENCY_WEIGHTED 2 /* weighted blended, in any order */
 
 #ifndef HAVE_GLUT
 /* xscreensaver setup */
@@ -176,6 +244,17 @@ static XrmOptionDescRec opts[] = {
     {"-no-wireframe", ".wireframe", XrmoptionNoArg, (caddr_t) "false"},
     {"-transparent", ".transparent", XrmoptionNoArg, (caddr_t) "true"},
     {"-no-transparent", ".transparent", XrmoptionNoArg, (caddr_t) "false"},
+    {"-snakes", ".snakes", XrmoptionSepArg, DEF_SNAKES},
+    {"-occlusion", ".occlusion", XrmoptionNoArg, (caddr_t) "true"},
+    {"-no-occlusion", ".occlusion", XrmoptionNoArg, (caddr_t) "false"},
+    {"-shaders", ".shaders", XrmoptionNoArg, (caddr_t) "true"},
+    {"-no-shaders", ".shaders", XrmoptionNoArg, (caddr_t) "false"},
+    {"-transparency", ".transparency", XrmoptionSepArg, DEF_TRANSPARENCY},
+    {"-software", ".software", XrmoptionNoArg, (caddr_t) "true"},
+    {"-no-software", ".software", XrmoptionNoArg, (caddr_t) "false"},
+    {"-maxfps", ".maxFPS", XrmoptionSepArg, DEF_MAXFPS},
+    {"-hud", ".hud", XrmoptionNoArg, (caddr_t) "true"},
+    {"-no-hud", ".hud", XrmoptionNoArg, (caddr_t) "false"},
 };
 
 static argtype vars[] = {
@@ -192,6 +271,13 @@ static argtype vars[] = {
     {&zoom, "zoom", "Zoom", DEF_ZOOM, t_Float},
     {&wireframe, "wireframe", "Wireframe", DEF_WIREFRAME, t_Bool},
     {&transparent, "transparent", "Transparent!", DEF_TRANSPARENT, t_Bool},
+    {&snakes, "snakes", "Snakes", DEF_SNAKES, t_Int},
+    {&occlusion, "occlusion", "Occlusion", DEF_OCCLUSION, t_Bool},
+    {&shaders, "shaders", "Shaders", DEF_SHADERS, t_Bool},
+    {&transparency, "transparency", "Transparency", DEF_TRANSPARENCY, t_Int},
+    {&software, "software", "Software", DEF_SOFTWARE, t_Bool},
+    {&maxfps, "maxFPS", "MaxFPS", DEF_MAXFPS, t_Int},
+    {&hud, "hud", "HUD", DEF_HUD, t_Bool},
 };
 
 ModeSpecOpt sws_opts = {(int)countof(opts), opts, (int)countof(vars), vars,
@@ -199,7 +285,12 @@ ModeSpecOpt sws_opts = {(int)countof(opts), opts, (int)countof(vars), vars,
 #endif
 
 struct glsnake_shape {
-  float node[NODE_COUNT];
+  unsigned char node[NODE_COUNT];
+};
+
+/* a shape part way through a morph, in fixed point ANGLE_ONE units */
+struct glsnake_pose {
+  int node[NODE_COUNT];
 };
 
 struct model_s {
@@ -216,6 +307,13 @@ int undo_ring_start;
 int undo_ring_end;
 #endif
 
+/* orthogonal snake metrics, see calc_snake_metrics_shape */
+struct snake_metrics {
+  int is_cyclic;
+  int is_legal;
+  int last_turn;
+};
+
 typedef int (*morph_func_t)(long);
 typedef float (*morph_percent_func_t)(void);
 
@@ -224,6 +322,8 @@ struct glsnake_cfg {
   GLXContext *glx_context;
   XFontStruct *font;
   GLuint font_list;
+  /* the -delay xscreensaver was started with, in microseconds */
+  unsigned long delay;
 #else
   /* font list number */
   int font;
@@ -243,13 +343,11 @@ struct glsnake_cfg {
   int paused;
 
   /* snake metrics */
-  int is_cyclic;
-  int is_legal;
-  float last_turn;
+  struct snake_metrics metrics;
   int debug;
 
   /* the current shape of the model */
-  struct glsnake_shape shape;
+  struct glsnake_pose shape;
 
   /* the shapes we are morphing from and morphing to */
   struct model_s prev_model_s;
@@ -265,26 +363,120 @@ struct glsnake_cfg {
   /* model morphing */
   int new_morph;
 
+  /* the largest rotation any joint makes during this morph, and how far
+   * through the morph we are */
+  int morph_span;
+  float morph_progress;
+
   /* colours */
   float colour[2][4];
   int next_colour;
   int prev_colour;
 
-  /* timing variables */
-  snaketime last_iteration;
-  snaketime last_morph;
+  /* msecs simulated since the last morph began */
+  long morph_clock;
 
   /* window size */
   int width, height;
   int old_width, old_height;
 
-  /* the id of the display lists for drawing a node */
-  GLuint node_solid, node_wire;
+  /* the id of the display lists for drawing a node, at full detail, as a
+   * plain prism, and as a point */
+  GLuint node_solid, node_wire, node_plain, node_point;
+
+  /* the level of detail each node was last drawn at */
+  unsigned char lod[NODE_COUNT];
 
   /* is the window fullscreen? */
   int fullscreen;
 };
 
+/* Many independent snakes, each with its own shape, morph target, colour
+ * and place.  Joints are stored one snake after another so that
+ * morph_joints can step the whole scene in one pass. */
+struct snake_scene {
+  int count;
+  /* snakes along each edge of the cube they are stacked in */
+  int size;
+  int *angle;            /* fixed point joint angles */
+  unsigned char *target; /* joint angles being morphed to */
+  int *span;             /* largest rotation of each snake's morph */
+  float *progress;       /* how far through its morph each snake is */
+  long *rest;            /* msecs left before each snake morphs again */
+  int (*scheme)[2];      /* colour schemes morphing from and to */
+  float (*colour)[2][4];
+  float (*place)[3];
+  /* the move count (see sim_state) each snake's kinematics were last
+   * worked out at */
+  unsigned int *posed;
+  float (*node_mat)[NODE_COUNT][16];
+  float (*com)[3];
+  float gap; /* the explode distance node_mat was worked out for */
+  /* collision broad phase: a box around each snake's target shape, and a
+   * uniform grid of hash buckets holding the snakes by their place */
+  float (*bounds)[2][3];
+  float reach; /* furthest any box reaches from its snake's place */
+  int (*cell)[3];
+  int buckets;
+  int *head;
+  int *next;
+  /* morph targets turned down because they would collide */
+  long replanned, rejected;
+  /* culling: the middle of each node, and a box and sphere round each
+   * snake, all relative to its centre of mass */
+  float (*centre)[NODE_COUNT][3];
+  float (*extent)[2][3];
+  float *radius;
+  /* snakes nearest first, and how far away each one is */
+  int *order;
+  float *depth;
+  unsigned char (*lod)[NODE_COUNT];
+  /* the nodes in view, as snake * NODE_COUNT + node, and their depths,
+   * for sorted transparency */
+  int *node_order;
+  float *node_depth;
+  /* an occlusion query per snake, whether it is waiting on a result,
+   * and whether the last result said the snake was hidden */
+  GLuint *query;
+  int *pending;
+  int *hidden;
+};
+
+/* Everything the renderer draws from, copied out of the simulation once a
+ * tick, so that the two can run on different threads. */
+struct sim_state {
+  /* the single snake */
+  struct glsnake_pose shape;
+  float colour[2][4];
+  const char *name;
+  int selected;
+  int morphing;
+  /* how far through their morphs the snakes are, and can the shape the
+   * single snake is heading for exist? */
+  float progress;
+  int legal;
+  /* a scene's joint angles and colours, and how many times the renderer
+   * has seen each snake's pose change */
+  int *angle;
+  float (*scene_colour)[2][4];
+  unsigned int *moved;
+  long replanned, rejected;
+  /* the time, in nanoseconds, that this is the state at */
+  long long stamp;
+  /* will nothing change until a key is pressed? */
+  int still;
+  /* the steps taken and keys acted on to get here */
+  unsigned long steps, keys;
+#ifdef PROFILE
+  /* when the newest key this reflects was pressed */
+  long long input;
+#endif
+  /* settings the keyboard changes */
+  GLfloat yspin, zspin;
+  GLfloat explode;
+  int interactive;
+};
+
 #define COLOUR_CYCLIC 0
 #define COLOUR_ACYCLIC 1
 #define COLOUR_INVALID 2
@@ -323,12 +515,13 @@ static float colour[][2][4] = {
  *
  *   Jamie
  */
-static struct model_s model[] = {
+static struct model_s builtin_model[] = {
 #define STRAIGHT_MODEL 0
     {"straight", {{ZERO, ZERO, ZERO, ZERO, ZERO, ZERO, ZERO, ZERO,
                    ZERO, ZERO, ZERO, ZERO, ZERO, ZERO, ZERO, ZERO,
                    ZERO, ZERO, ZERO, ZERO, ZERO, ZERO, ZERO, ZERO}}},
     /* the models in the Rubik's snake manual */
+#define BALL_MODEL 1
     {"ball", {{RIGHT, RIGHT, LEFT,  LEFT,  RIGHT, LEFT,  RIGHT, RIGHT,
                LEFT,  RIGHT, LEFT,  LEFT,  RIGHT, RIGHT, LEFT,  LEFT,
                RIGHT, LEFT,  RIGHT, RIGHT, LEFT,  RIGHT, LEFT,  ZERO}}},
@@ -1193,10 +1386,27 @@ static struct model_s model[] = {
             PIN,  LEFT,  LEFT, RIGHT, PIN,  ZERO,  ZERO,  ZERO}}},
 };
 
-static size_t models = sizeof(model) / sizeof(struct model_s);
+/* the catalogue, which -models can swap for one from a file; the straight
+ * model is always the built in one */
+static struct model_s *model = builtin_model;
+static size_t models = sizeof(builtin_model) / sizeof(struct model_s);
 
 #define VOFFSET 0.045
 
+/* Levels of detail for drawing a node, and the size on screen, as a radius
+ * in pixels, below which each level gives way to the next.  A node has to
+ * get LOD_HYSTERESIS bigger or smaller than the threshold to change level,
+ * so it doesn't flicker between two. */
+#define LOD_FULL 0
+#define LOD_PLAIN 1
+#define LOD_POINT 2
+#define LOD_LEVELS 3
+#define LOD_CULLED -1
+#define LOD_PLAIN_PIXELS 8.0
+#define LOD_POINT_PIXELS 2.5
+#define LOD_HYSTERESIS 0.15
+#define LOD_POINT_SIZE 3.0
+
 #define X_MASK 1
 #define Y_MASK 2
 #define Z_MASK 4
@@ -1271,6 +1481,35 @@ static float wire_prism_v[][3] = {{0.0, 0.0, 1.0}, {1.0, 0.0, 1.0},
                                   {0.0, 1.0, 1.0}, {0.0, 0.0, 0.0},
                                   {1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}};
 
+/* the faces of the solid prism: how many corners, the normal, and the
+ * corners, going round the bevelled corners, then edges, then faces */
+static const unsigned char solid_prism_f[][6] = {
+    /* corners */
+    {3, 0, 0, 2, 1},
+    {3, 1, 6, 7, 8},
+    {3, 2, 12, 13, 14},
+    {3, 3, 3, 4, 5},
+    {3, 4, 9, 11, 10},
+    {3, 5, 16, 15, 17},
+    /* edges */
+    {4, 6, 0, 12, 14, 2},
+    {4, 7, 0, 1, 7, 6},
+    {4, 8, 6, 8, 13, 12},
+    {4, 9, 3, 5, 17, 15},
+    {4, 10, 3, 9, 10, 4},
+    {4, 11, 15, 16, 11, 9},
+    {4, 12, 1, 2, 5, 4},
+    {4, 13, 8, 7, 10, 11},
+    {4, 14, 13, 16, 17, 14},
+    /* faces */
+    {3, 15, 0, 6, 12},
+    {3, 19, 3, 15, 9},
+    {4, 16, 1, 4, 10, 7},
+    {4, 17, 8, 11, 16, 13},
+    {4, 18, 2, 14, 17, 5}};
+
+#define SOLID_PRISM_FACES (sizeof(solid_prism_f) / sizeof(solid_prism_f[0]))
+
 #if 0
 /* this isn't used! */
 static float wire_prism_n[][3] = {{ 0.0, 0.0, 1.0},
@@ -1281,6 +1520,9 @@ static float wire_prism_n[][3] = {{ 0.0, 0.0, 1.0},
 #endif /* 0 */
 
 static struct glsnake_cfg *glc = NULL;
+static struct snake_scene *scene = NULL;
+/* the simulation state being drawn */
+static struct sim_state *shown = NULL;
 #ifdef HAVE_GLUT
 #define bp glc
 #endif
@@ -1291,6 +1533,11 @@ typedef float (*morphFunc)(long);
 /* forward definitions for GLUT functions */
 static void calc_rotation();
 static inline void ui_mousedrag();
+static void ui_drag(void);
+static void ui_key_command(int c);
+static void ui_special_command(int key);
+static void session_idle(void);
+static float rotation[16];
 #endif
 
 static GLfloat white_light[] = {1.0, 1.0, 1.0, 1.0};
@@ -1299,6 +1546,93 @@ static GLfloat lmodel_ambient[] = {0.2, 0.2, 0.2, 1.0};
 static GLfloat mat_specular[] = {0.1, 0.1, 0.1, 1.0};
 static GLfloat mat_shininess[] = {20.0};
 
+/* GL state tracking.  Material, capability, blend and depth mask changes
+ * go through here, which leaves out the ones that would change nothing,
+ * and counts calls, changes and draws for benchmark mode. */
+enum {
+  GLS_LIGHTING,
+  GLS_BLEND,
+  GLS_DEPTH_TEST,
+  GLS_COLOR_MATERIAL,
+  GLS_TEXTURE_2D,
+  GLS_ALPHA_TEST,
+  GLS_CAPS
+};
+
+static const GLenum gls_cap[GLS_CAPS] = {GL_LIGHTING,       GL_BLEND,
+                                         GL_DEPTH_TEST,     GL_COLOR_MATERIAL,
+                                         GL_TEXTURE_2D,     GL_ALPHA_TEST};
+
+static struct {
+  /* what GL was last told, or -1 if we don't know */
+  int cap[GLS_CAPS];
+  int depth_mask, blend_known;
+  GLenum blend[2];
+  /* front ambient and diffuse */
+  int material_known[2];
+  GLfloat material[2][4];
+  /* calls made through here, the ones passed on to GL, and draws */
+  unsigned long calls, changes, draws;
+} gls;
+
+/* forget what GL was last told, as for a new context */
+static void gls_forget(void) {
+  int i;
+
+  for (i = 0; i < GLS_CAPS; i++) gls.cap[i] = -1;
+  gls.depth_mask = -1;
+  gls.blend_known = 0;
+  gls.material_known[0] = gls.material_known[1] = 0;
+}
+
+static void gls_enable(int cap, int on) {
+  gls.calls++;
+  if (gls.cap[cap] == on) return;
+  gls.cap[cap] = on;
+  gls.changes++;
+  if (on)
+    glEnable(gls_cap[cap]);
+  else
+    glDisable(gls_cap[cap]);
+}
+
+static void gls_depth_mask(int on) {
+  gls.calls++;
+  if (gls.depth_mask == on) return;
+  gls.depth_mask = on;
+  gls.changes++;
+  glDepthMask(on ? GL_TRUE : GL_FALSE);
+}
+
+static void gls_blend_func(GLenum src, GLenum dst) {
+  gls.calls++;
+  if (gls.blend_known && gls.blend[0] == src && gls.blend[1] == dst) return;
+  gls.blend_known = 1;
+  gls.blend[0] = src;
+  gls.blend[1] = dst;
+  gls.changes++;
+  glBlendFunc(src, dst);
+}
+
+/* set the front material's GL_AMBIENT or GL_DIFFUSE colour */
+static void gls_material(GLenum pname, const GLfloat *rgba) {
+  int i = pname == GL_DIFFUSE;
+
+  gls.calls++;
+  if (gls.material_known[i] && !memcmp(gls.material[i], rgba, 4 * sizeof(*rgba)))
+    return;
+  gls.material_known[i] = 1;
+  memcpy(gls.material[i], rgba, 4 * sizeof(*rgba));
+  gls.changes++;
+  glMaterialfv(GL_FRONT, pname, rgba);
+}
+
+static void gls_call_list(GLuint list) {
+  gls.calls++;
+  gls.draws++;
+  glCallList(list);
+}
+
 void gl_init(
 #ifndef HAVE_GLUT
     ModeInfo *mi
@@ -1307,15 +1641,18 @@ void gl_init(
   float light_pos[][3] = {{0.0, 10.0, 20.0}, {0.0, 20.0, -1.0}};
   float light_dir[][3] = {{0.0, -10.0, -20.0}, {0.0, -20.0, 1.0}};
 
-  glEnable(GL_DEPTH_TEST);
+  gls_forget();
+  gls_enable(GLS_DEPTH_TEST, 1);
   glShadeModel(GL_SMOOTH);
   glCullFace(GL_BACK);
   /*glEnable(GL_CULL_FACE);*/
   glEnable(GL_NORMALIZE);
-  if (transparent) {
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glEnable(GL_BLEND);
-  }
+  gls_enable(GLS_COLOR_MATERIAL, 0);
+  gls_enable(GLS_TEXTURE_2D, 0);
+  gls_enable(GLS_ALPHA_TEST, 0);
+  gls_enable(GLS_BLEND, transparent);
+  if (transparent) gls_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  gls_enable(GLS_LIGHTING, !wireframe);
 
   if (!wireframe) {
     /*glColor4f(1.0, 1.0, 1.0, 1.0);*/
@@ -1332,7 +1669,6 @@ void gl_init(
     glLightModelfv(GL_LIGHT_MODEL_AMBIENT, lmodel_ambient);
     glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
     glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
-    glEnable(GL_LIGHTING);
     glEnable(GL_LIGHT0);
     glEnable(GL_LIGHT1);
     /*glEnable(GL_COLOR_MATERIAL);*/
@@ -1354,12 +1690,544 @@ static void gettime(snaketime *t) {
 #endif /* !HAVE_GETTIMEOFDAY */
 }
 
+/*
+ * Where the time comes from.  The simulation and all the scheduling of
+ * when to step and draw ask gettime_nsec() and sleep_until_nsec(), which
+ * normally go to the monotonic clock.  A soak test swaps in a virtual
+ * clock instead, which sleeping just moves on, so that days of stepping
+ * and morphing pass in minutes.  It is only for one thread.  Timing how
+ * long things really take uses real_nsec() whichever is in use.
+ */
+struct time_source {
+  long long (*now)(void);
+  void (*sleep_until)(long long when);
+};
+
+/* nanoseconds on a clock that never goes backwards */
+static long long real_nsec(void) {
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#else
+  snaketime t;
+
+  gettime(&t);
+  return (GETSECS(t) * 1000LL + GETMSECS(t)) * 1000000LL;
+#endif
+}
+
+/* sleep until real_nsec() reaches when */
+static void real_sleep_until(long long when) {
+#ifdef HAVE_CLOCK_NANOSLEEP
+  struct timespec ts;
+
+  ts.tv_sec = when / 1000000000LL;
+  ts.tv_nsec = when % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+#else
+  long long left = when - real_nsec();
+
+  if (left <= 0) return;
+#ifdef WIN32
+  Sleep((DWORD)(left / 1000000));
+#else
+  usleep(left / 1000);
+#endif
+#endif
+}
+
+static const struct time_source real_time = {real_nsec, real_sleep_until};
+static const struct time_source *time_source = &real_time;
+
+#ifdef HAVE_GLUT
+/* frames a second on the virtual clock, without -max-fps */
+#define VIRTUAL_FPS 30
+
+/* the virtual clock, in nanoseconds from when it started */
+static long long virtual_clock;
+
+static long long virtual_nsec(void) { return virtual_clock; }
+
+static void virtual_sleep_until(long long when) {
+  if (when > virtual_clock) virtual_clock = when;
+}
+
+static const struct time_source virtual_time = {virtual_nsec,
+                                                 virtual_sleep_until};
+#endif
+
+/* nanoseconds on the clock the simulation runs on */
+static long long gettime_nsec(void) { return time_source->now(); }
+
+/* sleep until gettime_nsec() reaches when */
+static void sleep_until_nsec(long long when) { time_source->sleep_until(when); }
+
+#ifdef HAVE_GLUT
+/*
+ * Recorded sessions.  -record writes the seed, the options, every input
+ * event, each key as the simulation acts on it and each frame to a file,
+ * each record a byte for its kind and then little endian 32 bit words.
+ * Keys go down against the number of steps taken before them, and frames
+ * against the steps and keys their state had seen and how far they were
+ * blended, which is everything the simulation and the blend depend on, so
+ * -replay plays the session out exactly, as fast as it will go, in a
+ * window or with -headless just the simulation.
+ */
+#define SESSION_MAGIC "GSNK"
+#define SESSION_VERSION 1
+#define SESSION_KEYS 256 /* keys read ahead of the frame that shows them */
+#define SESSION_ARGS 256 /* most options read back */
+#define SESSION_ARG 1024 /* longest option read back */
+#define SESSION_HASH 2166136261UL
+
+enum {
+  SESSION_START,    /* version, seed, spooky, argc, then argc strings */
+  SESSION_END,      /* frames, hash of what they showed */
+  SESSION_KEY,      /* steps, key: the simulation acted on a key */
+  SESSION_FRAME,    /* steps, keys, blend, usecs since the last frame */
+  SESSION_KEYBOARD, /* key, x, y */
+  SESSION_SPECIAL,  /* key, x, y */
+  SESSION_MOUSE,    /* button, state, x, y */
+  SESSION_MOTION,   /* x, y */
+  SESSION_RESHAPE,  /* width, height */
+  SESSION_KINDS
+};
+
+/* how many words each kind of record has */
+static const int session_words[SESSION_KINDS] = {4, 2, 2, 4, 3, 3, 4, 2, 2};
+
+/* is there no window, for a headless replay or a soak test?  And how many
+ * hours -soak runs for */
+static Bool headless;
+static int soak;
+
+/* Exporting frames, see film_run */
+#define FILM_PBOS 3     /* frames being read back at once */
+#define FILM_JOBS 32    /* frames being encoded or waiting to be written */
+#define FILM_THREADS 16 /* the most threads to encode on */
+
+/* what frames are encoded as; meshes go through the same jobs, a model
+ * to a frame */
+enum { FILM_PPM, FILM_Y4M, FILM_PNG, FILM_STL, FILM_OBJ, FILM_PLY };
+enum { FILM_FREE, FILM_READY, FILM_BUSY, FILM_DONE };
+
+/* A posed snake as triangles, see mesh_build.  The most it can come to
+ * is every node's bevelled prism, with each quad split in two. */
+#define MESH_VERTICES (18 * NODE_COUNT)
+#define MESH_TRIANGLES (32 * NODE_COUNT)
+
+struct mesh {
+  float vertex[MESH_VERTICES][3];
+  int triangle[MESH_TRIANGLES][3];
+  int vertices, triangles;
+};
+
+struct film_job {
+  int state;
+  long frame;
+  /* the frame as GL read it, RGBA from the bottom row up, the rows of a
+   * PNG before compression, or a model's mesh, and the encoded frame */
+  unsigned char *pixels, *raw, *out;
+  struct mesh *mesh;
+  size_t size;
+};
+
+static struct {
+  /* -export, -export-size and -export-frames */
+  const char *format, *size;
+  int frames;
+  int kind, width, height;
+  /* a file name with the frame number in it, for frames that aren't
+   * written to stdout, and room to print it */
+  const char *path;
+  char *name;
+  GLuint framebuffer, colour, depth;
+  /* the ring of pixel buffer objects, if there are any */
+  GLuint pbo[FILM_PBOS];
+  int pbos;
+  struct film_job job[FILM_JOBS];
+  /* frames written so far, and how big an encoded frame can be */
+  long written;
+  size_t room;
+  /* for PNG chunks */
+  unsigned long crc[256];
+#ifdef HAVE_PTHREAD
+  /* the encoders wait on go for jobs, and the writer on done for them */
+  pthread_t thread[FILM_THREADS];
+  int threads, stop;
+  pthread_mutex_t lock;
+  pthread_cond_t go, done;
+#endif
+} film;
+
+/* -models, the file to take the catalogue from */
+static const char *model_file;
+
+/* Contact sheets, see sheet_run: -sheets, -sheet-grid and -thumb-size,
+ * and those worked out */
+static struct {
+  const char *path, *grid, *thumb;
+  int columns, rows, width, height;
+} sheet;
+
+/* -meshes, -mesh-merge and -dump-meshes, see mesh_run and mesh_dump */
+static struct {
+  const char *path, *dump;
+  Bool merge;
+  /* the kind of file the d key writes, and how many it has */
+  int kind, dumped;
+} meshes;
+
+static void mesh_encode(struct film_job *job);
+
+static struct {
+  /* the files given to -record and -replay */
+  const char *record, *replay;
+  FILE *out, *in;
+  /* what random() was seeded with, and was it Halloween when the session
+   * began?  Once latched, it stays that way for the session. */
+  unsigned long seed;
+  int spooky, latched;
+  /* the options the session was recorded with */
+  int argc;
+  char **argv;
+  /* keys read ahead of the frame that shows them, and how many steps had
+   * been taken when each was acted on */
+  unsigned long key[SESSION_KEYS], key_step[SESSION_KEYS];
+  unsigned int head, tail;
+  /* frames so far, a hash of what they showed, and the hash the recording
+   * ended with, if the replay got that far */
+  unsigned long frames, hash, end_hash;
+  int ended;
+  /* when it started, when the last frame was, and how long the recording
+   * went on */
+  long long start, last, recorded;
+  /* has a replayed frame yet to be drawn? */
+  int due;
+} session;
+
+/* write a record, if recording, as one write so that the simulation's and
+ * the UI's records don't interleave */
+static void session_put(int kind, unsigned long a, unsigned long b,
+                        unsigned long c, unsigned long d) {
+  unsigned char buf[1 + 4 * 4];
+  unsigned long w[4];
+  int i, k;
+
+  if (!session.out) return;
+  w[0] = a;
+  w[1] = b;
+  w[2] = c;
+  w[3] = d;
+  buf[0] = kind;
+  for (i = 0; i < session_words[kind]; i++)
+    for (k = 0; k < 4; k++) buf[1 + 4 * i + k] = (w[i] >> (8 * k)) & 0xff;
+  fwrite(buf, 1, 1 + 4 * session_words[kind], session.out);
+}
+
+/* read a record's words; returns its kind, or -1 at the end */
+static int session_get(unsigned long *w) {
+  int kind = getc(session.in), i, k, c;
+
+  if (kind < 0 || kind >= SESSION_KINDS) return -1;
+  for (i = 0; i < session_words[kind]; i++)
+    for (w[i] = 0, k = 0; k < 4; k++) {
+      if ((c = getc(session.in)) == EOF) return -1;
+      w[i] |= (unsigned long)c << (8 * k);
+    }
+  return kind;
+}
+
+/* a word read back as the int that was written */
+static int session_int(unsigned long w) {
+  return w & 0x80000000UL ? -(int)(~w & 0x7fffffffUL) - 1 : (int)w;
+}
+
+/* floats go in a word as their bits */
+static unsigned long session_bits(float f) {
+  unsigned int u;
+
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+static float session_float(unsigned long w) {
+  unsigned int u = w;
+  float f;
+
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+/* fold a word into the hash of what the session showed, with FNV-1a */
+static void session_hash(unsigned long w) {
+  int k;
+
+  for (k = 0; k < 4; k++)
+    session.hash =
+        ((session.hash ^ ((w >> (8 * k)) & 0xff)) * 16777619UL) & 0xffffffffUL;
+}
+#endif
+
+/* Per-stage frame timing, built with -DPROFILE.  Each stage is only ever
+ * timed on one thread, so it keeps its own start time, and its histogram
+ * is only ever added to; the dump reads it as it stands.  Buckets are a
+ * quarter of a power of two wide, from a nanosecond to about 4 seconds. */
+#ifdef PROFILE
+enum {
+  PROF_IDLE,
+  PROF_STEP,
+  PROF_COLOUR,
+  PROF_METRICS,
+  PROF_DRAW,
+  PROF_TITLE,
+  PROF_SWAP,
+  PROF_FRAME,
+  /* the same, as the GPU saw them */
+  PROF_GPU_DRAW,
+  PROF_GPU_TITLE,
+  PROF_GPU_FRAME,
+  /* latency from a key being pressed to the step that acts on it, the
+   * first frame that shows it being drawn, and that frame being swapped */
+  PROF_KEY_STEP,
+  PROF_KEY_DRAWN,
+  PROF_KEY_SWAPPED,
+  /* the same from dragging the snake round with the mouse */
+  PROF_DRAG_DRAWN,
+  PROF_DRAG_SWAPPED,
+  PROF_STAGES
+};
+
+#define PROF_BUCKETS 128
+
+static const char *prof_name[PROF_STAGES] = {
+    "idle",  "step",     "colour",    "metrics",  "draw",
+    "title", "swap",     "frame",     "gpu_draw", "gpu_title",
+    "gpu_frame", "key_step", "key_drawn", "key_swapped", "drag_drawn",
+    "drag_swapped"};
+
+static struct {
+  long long start[PROF_STAGES];
+  unsigned long count[PROF_STAGES][PROF_BUCKETS];
+  long long total[PROF_STAGES], most[PROF_STAGES];
+} prof;
+
+/* On the renderer: the newest key press a frame has shown, when the one
+ * waiting to be swapped was pressed, and when the mouse drags waiting to
+ * be drawn and swapped began.  Zero when there is nothing waiting. */
+static struct {
+  long long seen, key_drawn, drag, drag_drawn;
+} prof_trace;
+
+/* set by SIGUSR1 or the P key, and cleared once the renderer dumps */
+static volatile sig_atomic_t prof_dump_due;
+
+#ifdef HAVE_PTHREAD
+#define PROF_ADD(p, n) __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+#define PROF_GET(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define PROF_SET(p, n) __atomic_store_n(p, n, __ATOMIC_RELAXED)
+#else
+#define PROF_ADD(p, n) (*(p) += (n))
+#define PROF_GET(p) (*(p))
+#define PROF_SET(p, n) (*(p) = (n))
+#endif
+
+/* which bucket a time of ns nanoseconds falls in */
+static int prof_bucket(long long ns) {
+  int b = 2;
+
+  if (ns < 4) return (int)MAX(ns, 0);
+  while (b < 62 && ns >> (b + 1)) b++;
+  return MIN(b * 4 + (int)((ns >> (b - 2)) & 3), PROF_BUCKETS - 1);
+}
+
+/* the shortest time that falls in bucket i */
+static long long prof_floor(int i) {
+  if (i < 8) return i < 4 ? i : 4;
+  return (long long)(4 + i % 4) << (i / 4 - 2);
+}
+
+static void prof_record(int stage, long long ns) {
+  PROF_ADD(&prof.count[stage][prof_bucket(ns)], 1);
+  PROF_ADD(&prof.total[stage], ns);
+  if (ns > PROF_GET(&prof.most[stage])) PROF_SET(&prof.most[stage], ns);
+}
+
+static void prof_end(int stage) {
+  prof_record(stage, real_nsec() - prof.start[stage]);
+}
+
+/* a frame has been drawn; is it the first to show some input? */
+static void prof_trace_drawn(void) {
+  long long now = real_nsec();
+
+  if (shown->input != prof_trace.seen) {
+    prof_trace.seen = prof_trace.key_drawn = shown->input;
+    prof_record(PROF_KEY_DRAWN, now - shown->input);
+  }
+  if (prof_trace.drag) {
+    prof_trace.drag_drawn = prof_trace.drag;
+    prof_trace.drag = 0;
+    prof_record(PROF_DRAG_DRAWN, now - prof_trace.drag_drawn);
+  }
+}
+
+/* the frame has been swapped */
+static void prof_trace_swapped(void) {
+  long long now = real_nsec();
+
+  if (prof_trace.key_drawn)
+    prof_record(PROF_KEY_SWAPPED, now - prof_trace.key_drawn);
+  if (prof_trace.drag_drawn)
+    prof_record(PROF_DRAG_SWAPPED, now - prof_trace.drag_drawn);
+  prof_trace.key_drawn = prof_trace.drag_drawn = 0;
+}
+
+/* the mouse moved the snake; follow the first move until it is drawn */
+static void prof_trace_drag(void) {
+  if (!prof_trace.drag) prof_trace.drag = real_nsec();
+}
+
+/* GPU timestamps at the start of a frame, once the scene has been
+ * submitted, and once the title has; a ring of frames of them is read
+ * back a few frames later, and any not ready by then are dropped, so
+ * reading them never waits on the GPU */
+enum { PROF_MARK_START, PROF_MARK_DRAWN, PROF_MARK_TITLED, PROF_MARKS };
+
+#define PROF_GPU_FRAMES 4
+
+static struct {
+  int on;
+#ifdef GL_VERSION_3_3
+  GLuint query[PROF_GPU_FRAMES][PROF_MARKS];
+#endif
+  int issued[PROF_GPU_FRAMES];
+  unsigned int frame;
+} prof_gpu;
+
+/* Set up timer queries, if the GL has them, from 3.3 or
+ * GL_ARB_timer_query. */
+static void prof_gpu_init(void) {
+#ifdef GL_VERSION_3_3
+  const char *version = (const char *)glGetString(GL_VERSION);
+  const char *ext = (const char *)glGetString(GL_EXTENSIONS);
+  int major = 0, minor = 0;
+
+  if ((!version || sscanf(version, "%d.%d", &major, &minor) != 2 ||
+       major * 10 + minor < 33) &&
+      !(ext && strstr(ext, "GL_ARB_timer_query")))
+    return;
+  glGenQueries(PROF_GPU_FRAMES * PROF_MARKS, &prof_gpu.query[0][0]);
+  prof_gpu.on = 1;
+#endif
+}
+
+/* Record when the GPU reaches this point in the frame.  At the start of a
+ * frame, first collect the frame that last used this slot of the ring. */
+static void prof_gpu_mark(int mark) {
+#ifdef GL_VERSION_3_3
+  int slot = prof_gpu.frame % PROF_GPU_FRAMES;
+  GLuint64 t[PROF_MARKS];
+  GLint ready = 0;
+  int i;
+
+  if (!prof_gpu.on) return;
+
+  if (mark == PROF_MARK_START && prof_gpu.issued[slot]) {
+    glGetQueryObjectiv(prof_gpu.query[slot][PROF_MARK_TITLED],
+                       GL_QUERY_RESULT_AVAILABLE, &ready);
+    if (ready) {
+      for (i = 0; i < PROF_MARKS; i++)
+        glGetQueryObjectui64v(prof_gpu.query[slot][i], GL_QUERY_RESULT, &t[i]);
+      prof_record(PROF_GPU_DRAW,
+                  (long long)(t[PROF_MARK_DRAWN] - t[PROF_MARK_START]));
+      prof_record(PROF_GPU_TITLE,
+                  (long long)(t[PROF_MARK_TITLED] - t[PROF_MARK_DRAWN]));
+      prof_record(PROF_GPU_FRAME,
+                  (long long)(t[PROF_MARK_TITLED] - t[PROF_MARK_START]));
+    }
+    prof_gpu.issued[slot] = 0;
+  }
+
+  glQueryCounter(prof_gpu.query[slot][mark], GL_TIMESTAMP);
+  if (mark == PROF_MARK_TITLED) {
+    prof_gpu.issued[slot] = 1;
+    prof_gpu.frame++;
+  }
+#else
+  (void)mark;
+#endif
+}
+
+/* the time below which a fraction q of the stage's samples fall */
+static double prof_percentile(int stage, unsigned long n, double q) {
+  unsigned long seen = 0;
+  int i;
+
+  for (i = 0; i < PROF_BUCKETS; i++) {
+    seen += PROF_GET(&prof.count[stage][i]);
+    if (seen > 0 && seen >= q * n) return prof_floor(i) / 1000.0;
+  }
+  return prof_floor(PROF_BUCKETS - 1) / 1000.0;
+}
+
+/* write every stage's timings to stderr, as CSV in microseconds */
+static void prof_dump(void) {
+  unsigned long n;
+  int s, i;
+
+  fprintf(stderr, "stage,count,mean,p50,p90,p99,max\n");
+  for (s = 0; s < PROF_STAGES; s++) {
+    for (n = 0, i = 0; i < PROF_BUCKETS; i++)
+      n += PROF_GET(&prof.count[s][i]);
+    if (n == 0) continue;
+    fprintf(stderr, "%s,%lu,%.1f,%.1f,%.1f,%.1f,%.1f\n", prof_name[s], n,
+            PROF_GET(&prof.total[s]) / 1000.0 / n,
+            prof_percentile(s, n, 0.5), prof_percentile(s, n, 0.9),
+            prof_percentile(s, n, 0.99), PROF_GET(&prof.most[s]) / 1000.0);
+  }
+}
+
+/* dump the timings if asked to since the last frame */
+static void prof_poll(void) {
+  if (!prof_dump_due) return;
+  prof_dump_due = 0;
+  prof_dump();
+}
+
+#ifdef SIGUSR1
+static void prof_signal(int sig ATTRIBUTE_UNUSED) { prof_dump_due = 1; }
+#endif
+
+#define PROF_BEGIN(stage) (prof.start[stage] = real_nsec())
+#define PROF_END(stage) prof_end(stage)
+#define PROF_POLL() prof_poll()
+#define PROF_GPU(mark) prof_gpu_mark(mark)
+#define PROF_TRACE_DRAWN() prof_trace_drawn()
+#define PROF_TRACE_SWAPPED() prof_trace_swapped()
+#define PROF_TRACE_DRAG() prof_trace_drag()
+#else
+#define PROF_BEGIN(stage) ((void)0)
+#define PROF_END(stage) ((void)0)
+#define PROF_POLL() ((void)0)
+#define PROF_GPU(mark) ((void)0)
+#define PROF_TRACE_DRAWN() ((void)0)
+#define PROF_TRACE_SWAPPED() ((void)0)
+#define PROF_TRACE_DRAG() ((void)0)
+#endif
+
 static void start_morph(unsigned int model_index, int immediate);
 static void start_morph_shape(struct glsnake_shape *shape, int immediate);
 static float morph_percent(void);
 static int morph_all_at_once(long iter_msec);
 static int morph_one_at_a_time(long iter_msec);
 static float morph_percent_one_at_a_time(void);
+static struct snake_scene *scene_new(int count);
+static int glsl_init(void);
+static void sim_init(void);
 
 struct morph_method_t {
   morph_func_t morph;
@@ -1380,6 +2248,8 @@ void glsnake_init(
     ModeInfo *mi
 #endif
 ) {
+  size_t i;
+  int j;
 #ifndef HAVE_GLUT
   struct glsnake_cfg *bp;
 
@@ -1393,163 +2263,62 @@ void glsnake_init(
     }
   }
   bp = &glc[MI_SCREEN(mi)];
+  bp->delay = mi->pause;
 
   if ((bp->glx_context = init_GL(mi)) != NULL) {
     gl_init(mi);
     glsnake_reshape(mi, MI_WIDTH(mi), MI_HEIGHT(mi));
   }
 #else
-  gl_init();
+  if (!headless) gl_init();
 #endif
 
   /* initialise conf struct */
-  memset(&bp->shape.node, 0, sizeof(float) * NODE_COUNT);
+  memset(&bp->shape.node, 0, sizeof(int) * NODE_COUNT);
 
   bp->selected = 11;
-  bp->is_cyclic = 0;
-  bp->is_legal = 1;
-  bp->last_turn = -1;
+  bp->metrics.is_cyclic = 0;
+  bp->metrics.is_legal = 1;
+  bp->metrics.last_turn = -1;
   bp->morphing = 0;
   bp->paused = 0;
   bp->new_morph = 0;
   bp->morph = morph_one_at_a_time;
   bp->morph_percent = morph_percent_one_at_a_time;
 
-  gettime(&bp->last_iteration);
-  memcpy(&bp->last_morph, &bp->last_iteration, sizeof(bp->last_morph));
+  bp->morph_clock = 0;
 
   bp->prev_colour = bp->next_colour = COLOUR_ACYCLIC;
-  start_morph(START_MODEL, 1);
+  start_morph(models > START_MODEL ? START_MODEL : 0, 1);
+
+#ifdef HAVE_GLUT
+  /* without a window, there is only the simulation to set up */
+  if (headless) {
+    if (snakes > 1 && (scene = scene_new(snakes)) == NULL) {
+      fprintf(stderr, "glsnake: out of memory for %d snakes\n", snakes);
+      exit(1);
+    }
+    sim_init();
+    return;
+  }
+#endif
 
 /* set up a font for the labels */
 #ifndef HAVE_GLUT
-  if (titles) load_font(mi->dpy, "labelfont", &bp->font, &bp->font_list);
+  if (titles || hud) load_font(mi->dpy, "labelfont", &bp->font, &bp->font_list);
 #endif
 
   /* build a solid display list */
   glc->node_solid = glGenLists(1);
   glNewList(glc->node_solid, GL_COMPILE);
-  /* corners */
-  glBegin(GL_TRIANGLES);
-  glNormal3fv(solid_prism_n[0]);
-  glVertex3fv(solid_prism_v[0]);
-  glVertex3fv(solid_prism_v[2]);
-  glVertex3fv(solid_prism_v[1]);
-
-  glNormal3fv(solid_prism_n[1]);
-  glVertex3fv(solid_prism_v[6]);
-  glVertex3fv(solid_prism_v[7]);
-  glVertex3fv(solid_prism_v[8]);
-
-  glNormal3fv(solid_prism_n[2]);
-  glVertex3fv(solid_prism_v[12]);
-  glVertex3fv(solid_prism_v[13]);
-  glVertex3fv(solid_prism_v[14]);
-
-  glNormal3fv(solid_prism_n[3]);
-  glVertex3fv(solid_prism_v[3]);
-  glVertex3fv(solid_prism_v[4]);
-  glVertex3fv(solid_prism_v[5]);
-
-  glNormal3fv(solid_prism_n[4]);
-  glVertex3fv(solid_prism_v[9]);
-  glVertex3fv(solid_prism_v[11]);
-  glVertex3fv(solid_prism_v[10]);
-
-  glNormal3fv(solid_prism_n[5]);
-  glVertex3fv(solid_prism_v[16]);
-  glVertex3fv(solid_prism_v[15]);
-  glVertex3fv(solid_prism_v[17]);
-  glEnd();
-  /* edges */
-  glBegin(GL_QUADS);
-  glNormal3fv(solid_prism_n[6]);
-  glVertex3fv(solid_prism_v[0]);
-  glVertex3fv(solid_prism_v[12]);
-  glVertex3fv(solid_prism_v[14]);
-  glVertex3fv(solid_prism_v[2]);
-
-  glNormal3fv(solid_prism_n[7]);
-  glVertex3fv(solid_prism_v[0]);
-  glVertex3fv(solid_prism_v[1]);
-  glVertex3fv(solid_prism_v[7]);
-  glVertex3fv(solid_prism_v[6]);
-
-  glNormal3fv(solid_prism_n[8]);
-  glVertex3fv(solid_prism_v[6]);
-  glVertex3fv(solid_prism_v[8]);
-  glVertex3fv(solid_prism_v[13]);
-  glVertex3fv(solid_prism_v[12]);
-
-  glNormal3fv(solid_prism_n[9]);
-  glVertex3fv(solid_prism_v[3]);
-  glVertex3fv(solid_prism_v[5]);
-  glVertex3fv(solid_prism_v[17]);
-  glVertex3fv(solid_prism_v[15]);
-
-  glNormal3fv(solid_prism_n[10]);
-  glVertex3fv(solid_prism_v[3]);
-  glVertex3fv(solid_prism_v[9]);
-  glVertex3fv(solid_prism_v[10]);
-  glVertex3fv(solid_prism_v[4]);
-
-  glNormal3fv(solid_prism_n[11]);
-  glVertex3fv(solid_prism_v[15]);
-  glVertex3fv(solid_prism_v[16]);
-  glVertex3fv(solid_prism_v[11]);
-  glVertex3fv(solid_prism_v[9]);
-
-  glNormal3fv(solid_prism_n[12]);
-  glVertex3fv(solid_prism_v[1]);
-  glVertex3fv(solid_prism_v[2]);
-  glVertex3fv(solid_prism_v[5]);
-  glVertex3fv(solid_prism_v[4]);
-
-  glNormal3fv(solid_prism_n[13]);
-  glVertex3fv(solid_prism_v[8]);
-  glVertex3fv(solid_prism_v[7]);
-  glVertex3fv(solid_prism_v[10]);
-  glVertex3fv(solid_prism_v[11]);
-
-  glNormal3fv(solid_prism_n[14]);
-  glVertex3fv(solid_prism_v[13]);
-  glVertex3fv(solid_prism_v[16]);
-  glVertex3fv(solid_prism_v[17]);
-  glVertex3fv(solid_prism_v[14]);
-  glEnd();
-
-  /* faces */
-  glBegin(GL_TRIANGLES);
-  glNormal3fv(solid_prism_n[15]);
-  glVertex3fv(solid_prism_v[0]);
-  glVertex3fv(solid_prism_v[6]);
-  glVertex3fv(solid_prism_v[12]);
-
-  glNormal3fv(solid_prism_n[19]);
-  glVertex3fv(solid_prism_v[3]);
-  glVertex3fv(solid_prism_v[15]);
-  glVertex3fv(solid_prism_v[9]);
-  glEnd();
-
-  glBegin(GL_QUADS);
-  glNormal3fv(solid_prism_n[16]);
-  glVertex3fv(solid_prism_v[1]);
-  glVertex3fv(solid_prism_v[4]);
-  glVertex3fv(solid_prism_v[10]);
-  glVertex3fv(solid_prism_v[7]);
-
-  glNormal3fv(solid_prism_n[17]);
-  glVertex3fv(solid_prism_v[8]);
-  glVertex3fv(solid_prism_v[11]);
-  glVertex3fv(solid_prism_v[16]);
-  glVertex3fv(solid_prism_v[13]);
+  for (i = 0; i < SOLID_PRISM_FACES; i++) {
+    const unsigned char *face = solid_prism_f[i];
 
-  glNormal3fv(solid_prism_n[18]);
-  glVertex3fv(solid_prism_v[2]);
-  glVertex3fv(solid_prism_v[14]);
-  glVertex3fv(solid_prism_v[17]);
-  glVertex3fv(solid_prism_v[5]);
-  glEnd();
+    glBegin(face[0] == 3 ? GL_TRIANGLES : GL_QUADS);
+    glNormal3fv(solid_prism_n[face[1]]);
+    for (j = 0; j < face[0]; j++) glVertex3fv(solid_prism_v[face[2 + j]]);
+    glEnd();
+  }
   glEndList();
 
   /* build wire display list */
@@ -1573,93 +2342,494 @@ void glsnake_init(
   glEnd();
   glEndList();
 
+  /* build a plain prism display list, without the bevels */
+  glc->node_plain = glGenLists(1);
+  glNewList(glc->node_plain, GL_COMPILE);
+  glBegin(GL_TRIANGLES);
+  glNormal3fv(solid_prism_n[15]);
+  glVertex3fv(wire_prism_v[0]);
+  glVertex3fv(wire_prism_v[1]);
+  glVertex3fv(wire_prism_v[2]);
+
+  glNormal3fv(solid_prism_n[19]);
+  glVertex3fv(wire_prism_v[3]);
+  glVertex3fv(wire_prism_v[5]);
+  glVertex3fv(wire_prism_v[4]);
+
+  glNormal3fv(solid_prism_n[16]);
+  glVertex3fv(wire_prism_v[0]);
+  glVertex3fv(wire_prism_v[3]);
+  glVertex3fv(wire_prism_v[4]);
+  glVertex3fv(wire_prism_v[0]);
+  glVertex3fv(wire_prism_v[4]);
+  glVertex3fv(wire_prism_v[1]);
+
+  glNormal3fv(solid_prism_n[17]);
+  glVertex3fv(wire_prism_v[1]);
+  glVertex3fv(wire_prism_v[4]);
+  glVertex3fv(wire_prism_v[5]);
+  glVertex3fv(wire_prism_v[1]);
+  glVertex3fv(wire_prism_v[5]);
+  glVertex3fv(wire_prism_v[2]);
+
+  glNormal3fv(solid_prism_n[18]);
+  glVertex3fv(wire_prism_v[0]);
+  glVertex3fv(wire_prism_v[2]);
+  glVertex3fv(wire_prism_v[5]);
+  glVertex3fv(wire_prism_v[0]);
+  glVertex3fv(wire_prism_v[5]);
+  glVertex3fv(wire_prism_v[3]);
+  glEnd();
+  glEndList();
+
+  /* and a point in the middle of the prism, for nodes a few pixels big */
+  glc->node_point = glGenLists(1);
+  glNewList(glc->node_point, GL_COMPILE);
+  glBegin(GL_POINTS);
+  glNormal3fv(solid_prism_n[15]);
+  glVertex3f(1.0 / 3.0, 1.0 / 3.0, 0.5);
+  glEnd();
+  glEndList();
+  glPointSize(LOD_POINT_SIZE);
+
+  /* the software renderer has no shaders, so it sorts */
+  if (software) {
+    shaders = 0;
+    if (transparency == TRANSPARENCY_WEIGHTED)
+      transparency = TRANSPARENCY_SORTED;
+  }
+
+  /* weighted blended transparency is done in the shaders */
+  if (transparency == TRANSPARENCY_WEIGHTED) shaders = 1;
+  if (shaders && !glsl_init()) {
+    fprintf(stderr, "glsnake: can't use shaders, drawing the old way\n");
+    shaders = 0;
+    if (transparency == TRANSPARENCY_WEIGHTED)
+      transparency = TRANSPARENCY_SORTED;
+  }
+
+  if (snakes > 1 && !scene) {
+    if ((scene = scene_new(snakes)) == NULL) {
+      fprintf(stderr, "glsnake: out of memory for %d snakes\n", snakes);
+      exit(1);
+    }
+  }
+
+  sim_init();
+
+#ifdef PROFILE
+  prof_gpu_init();
+#ifdef SIGUSR1
+  signal(SIGUSR1, prof_signal);
+#endif
+#endif
+
 #ifdef HAVE_GLUT
   /* initialise the rotation */
   calc_rotation();
 #endif
 }
 
-static void draw_title(
+/* Text, drawn from an atlas: the bitmap font is drawn once into a texture
+ * on an FBO, and after that each character is a textured quad, and all
+ * the text in a frame goes to GL in one draw.  Without FBOs the title is
+ * drawn a bitmap at a time, as it always was, and there is no HUD. */
+#define TEXT_FIRST 32   /* the first character in the atlas */
+#define TEXT_GLYPHS 95  /* and how many there are, up to ~ */
+#define TEXT_COLUMNS 16 /* cells across the atlas */
+#define TEXT_QUADS 512  /* most characters drawn in a frame */
+
+static struct {
+  int tried;
+  GLuint texture;
+  /* size of a cell in pixels, and how far up it the baseline is */
+  int cell, base;
+  unsigned char advance[TEXT_GLYPHS];
+  /* x, y, s, t of each corner of each character queued this frame */
+  GLfloat vertex[TEXT_QUADS * 4][4];
+  int quads;
+} atlas;
+
+/* draw character c at the raster position with the platform's font */
+static void text_glyph(
 #ifndef HAVE_GLUT
-    ModeInfo *mi
+    struct glsnake_cfg *bp,
 #endif
-) {
-#ifndef HAVE_GLUT
-  struct glsnake_cfg *bp = &glc[MI_SCREEN(mi)];
+    int c) {
+#ifdef HAVE_GLUT
+  glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, c);
+#else
+  glCallList(bp->font_list + c);
 #endif
+}
 
-  /* draw some text */
-  glPushAttrib((GLbitfield)GL_TRANSFORM_BIT | GL_ENABLE_BIT);
-  glDisable(GL_LIGHTING);
-  glDisable(GL_DEPTH_TEST);
-  if (transparent) {
-    glDisable(GL_BLEND);
+/* how far the raster position moves past character c */
+static int text_advance(
+#ifndef HAVE_GLUT
+    struct glsnake_cfg *bp,
+#endif
+    int c) {
+#ifdef HAVE_GLUT
+  return glutBitmapWidth(GLUT_BITMAP_HELVETICA_12, c);
+#else
+  char ch = (char)c;
+
+  return XTextWidth(bp->font, &ch, 1);
+#endif
+}
+
+/* Draw the font into the atlas, the first time through.  This leaves the
+ * projection and modelview matrices for the caller to set.  Returns 0 if
+ * there is no atlas. */
+static int text_atlas(
+#ifndef HAVE_GLUT
+    struct glsnake_cfg *bp
+#endif
+) {
+#ifdef GL_VERSION_3_0
+  const char *version = (const char *)glGetString(GL_VERSION);
+  const char *ext = (const char *)glGetString(GL_EXTENSIONS);
+  int major = 0, minor = 0, width, height, i;
+  GLint previous, viewport[4];
+  GLfloat clear[4];
+  GLuint framebuffer;
+
+  if (atlas.tried) return atlas.texture != 0;
+  atlas.tried = 1;
+  if ((!version || sscanf(version, "%d.%d", &major, &minor) != 2 ||
+       major < 3) &&
+      !(ext && strstr(ext, "GL_ARB_framebuffer_object")))
+    return 0;
+
+#ifdef HAVE_GLUT
+  atlas.cell = 16;
+  atlas.base = 4;
+#else
+  atlas.cell = bp->font->ascent + bp->font->descent + 2;
+  atlas.base = bp->font->descent + 1;
+#endif
+  width = TEXT_COLUMNS * atlas.cell;
+  height = (TEXT_GLYPHS + TEXT_COLUMNS - 1) / TEXT_COLUMNS * atlas.cell;
+
+  glGenTextures(1, &atlas.texture);
+  glBindTexture(GL_TEXTURE_2D, atlas.texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, NULL);
+
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         atlas.texture, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE) {
+    glViewport(0, 0, width, height);
+    glClearColor(0.0, 0.0, 0.0, 0.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    gluOrtho2D(0.0, (GLdouble)width, 0.0, (GLdouble)height);
+    glColor4f(1.0, 1.0, 1.0, 1.0);
+    for (i = 0; i < TEXT_GLYPHS; i++) {
+      glRasterPos2i(i % TEXT_COLUMNS * atlas.cell + 1,
+                    i / TEXT_COLUMNS * atlas.cell + atlas.base);
+#ifdef HAVE_GLUT
+      text_glyph(TEXT_FIRST + i);
+      atlas.advance[i] = text_advance(TEXT_FIRST + i);
+#else
+      text_glyph(bp, TEXT_FIRST + i);
+      atlas.advance[i] = text_advance(bp, TEXT_FIRST + i);
+#endif
+    }
+  } else {
+    glDeleteTextures(1, &atlas.texture);
+    atlas.texture = 0;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, previous);
+  glDeleteFramebuffers(1, &framebuffer);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  glClearColor(clear[0], clear[1], clear[2], clear[3]);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glAlphaFunc(GL_GREATER, 0.5);
+  return atlas.texture != 0;
+#else
+  return 0;
+#endif
+}
+
+/* how wide s will be, in pixels */
+static int text_width(const char *s) {
+  int w = 0;
+
+  for (; *s; s++)
+    if (*s >= TEXT_FIRST && *s < TEXT_FIRST + TEXT_GLYPHS)
+      w += atlas.advance[*s - TEXT_FIRST];
+  return w;
+}
+
+/* queue s to be drawn with its baseline starting at x, y */
+static void text_string(float x, float y, const char *s) {
+  float w = TEXT_COLUMNS * atlas.cell;
+  float h = (TEXT_GLYPHS + TEXT_COLUMNS - 1) / TEXT_COLUMNS * atlas.cell;
+  GLfloat(*v)[4];
+  int i, k;
+
+  for (; *s && atlas.quads < TEXT_QUADS; s++) {
+    if (*s < TEXT_FIRST || *s >= TEXT_FIRST + TEXT_GLYPHS) continue;
+    i = *s - TEXT_FIRST;
+    v = atlas.vertex + 4 * atlas.quads++;
+    for (k = 0; k < 4; k++) {
+      int right = k == 1 || k == 2, top = k >= 2;
+
+      v[k][0] = x - 1 + right * atlas.cell;
+      v[k][1] = y - atlas.base + top * atlas.cell;
+      v[k][2] = (i % TEXT_COLUMNS + right) * atlas.cell / w;
+      v[k][3] = (i / TEXT_COLUMNS + top) * atlas.cell / h;
+    }
+    x += atlas.advance[i];
   }
+}
+
+/* draw all the text queued this frame */
+static void text_flush(void) {
+  if (!atlas.quads) return;
+  gls_enable(GLS_TEXTURE_2D, 1);
+  gls_enable(GLS_ALPHA_TEST, 1);
+  glBindTexture(GL_TEXTURE_2D, atlas.texture);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  glVertexPointer(2, GL_FLOAT, sizeof(atlas.vertex[0]), &atlas.vertex[0][0]);
+  glTexCoordPointer(2, GL_FLOAT, sizeof(atlas.vertex[0]), &atlas.vertex[0][2]);
+  glDrawArrays(GL_QUADS, 0, 4 * atlas.quads);
+  gls.draws++;
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  gls_enable(GLS_ALPHA_TEST, 0);
+  gls_enable(GLS_TEXTURE_2D, 0);
+  atlas.quads = 0;
+}
+
+/* The performance HUD: the frame rate and a graph of the last HUD_GRAPH
+ * frame times, and how the snake is getting on. */
+#define HUD_GRAPH 120
+#define HUD_GRAPH_MSEC 50.0 /* frame time at the top of the graph */
+
+static struct {
+  GLfloat line[HUD_GRAPH][2];
+  float msec[HUD_GRAPH];
+  int next, count;
+  long long last;
+} hud_frames;
+
+/* note that a frame was drawn at time now, in nanoseconds */
+static void hud_frame(long long now) {
+  if (hud_frames.last) {
+    hud_frames.msec[hud_frames.next] = (now - hud_frames.last) / 1e6;
+    hud_frames.next = (hud_frames.next + 1) % HUD_GRAPH;
+    if (hud_frames.count < HUD_GRAPH) hud_frames.count++;
+  }
+  hud_frames.last = now;
+}
+
+/* queue the HUD's text, and draw its graph, in a window height high */
+static void hud_draw(int height) {
+  float total = 0.0, y = height - atlas.cell;
+  char line[80];
+  int i, n = hud_frames.count;
+
+  for (i = 0; i < n; i++) total += hud_frames.msec[i];
+  sprintf(line, "%.1f fps, %.2f ms/frame", n ? n * 1000.0 / total : 0.0,
+          n ? total / n : 0.0);
+  text_string(8, y, line);
+  y -= atlas.cell;
+
+  if (scene)
+    sprintf(line, "%d snakes, %.0f%% through their morphs", scene->count,
+            shown->progress * 100.0);
+  else if (shown->morphing)
+    sprintf(line, "morphing, %.0f%%", shown->progress * 100.0);
+  else
+    sprintf(line, "still");
+  text_string(8, y, line);
+  y -= atlas.cell;
+
+  if (!scene) {
+    text_string(8, y, shown->legal ? "legal" : "illegal, it meets itself");
+    y -= atlas.cell;
+    sprintf(line, "model: %.60s", shown->interactive ? "interactive"
+                                                     : shown->name);
+    text_string(8, y, line);
+    y -= atlas.cell;
+  }
+
+  /* the graph, oldest frame on the left */
+  for (i = 0; i < n; i++) {
+    float msec = hud_frames.msec[(hud_frames.next - n + i + HUD_GRAPH) %
+                                 HUD_GRAPH];
+
+    hud_frames.line[i][0] = 8 + 2 * i;
+    hud_frames.line[i][1] = y - 40.0 + 40.0 * MIN(msec, HUD_GRAPH_MSEC) /
+                                           HUD_GRAPH_MSEC;
+  }
+  if (n < 2) return;
+  glColor4f(0.4, 0.8, 0.2, 1.0);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(2, GL_FLOAT, 0, &hud_frames.line[0][0]);
+  glDrawArrays(GL_LINE_STRIP, 0, n);
+  gls.draws++;
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glColor4f(1.0, 1.0, 1.0, 1.0);
+}
+
+static void draw_title(
+#ifndef HAVE_GLUT
+    ModeInfo *mi
+#endif
+) {
+#ifndef HAVE_GLUT
+  struct glsnake_cfg *bp = &glc[MI_SCREEN(mi)];
+  int width = mi->xgwa.width, height = mi->xgwa.height;
+#else
+  int width = glc->width, height = glc->height;
+#endif
+  int was[GLS_CAPS], text;
+  char scenestr[32];
+  const char *s;
+
+  if (scene) {
+    sprintf(scenestr, "%d snakes", scene->count);
+    s = scenestr;
+  } else if (shown->interactive)
+    s = "interactive";
+  else
+    s = shown->name;
+
+  /* draw some text, putting back only the state we change, as GL would
+   * have to save all of it for glPushAttrib */
+  memcpy(was, gls.cap, sizeof(was));
+  gls_enable(GLS_LIGHTING, 0);
+  gls_enable(GLS_DEPTH_TEST, 0);
+  gls_enable(GLS_BLEND, 0);
   glMatrixMode(GL_PROJECTION);
   glPushMatrix();
-  glLoadIdentity();
   glMatrixMode(GL_MODELVIEW);
   glPushMatrix();
-  glLoadIdentity();
 #ifdef HAVE_GLUT
-  gluOrtho2D((GLdouble)0., (GLdouble)glc->width, (GLdouble)0.,
-             (GLdouble)glc->height);
+  text = text_atlas();
 #else
-  gluOrtho2D((GLdouble)0., (GLdouble)mi->xgwa.width, (GLdouble)0.,
-             (GLdouble)mi->xgwa.height);
+  text = text_atlas(bp);
 #endif
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  gluOrtho2D((GLdouble)0., (GLdouble)width, (GLdouble)0., (GLdouble)height);
   glColor4f(1.0, 1.0, 1.0, 1.0);
-  {
-    char interactstr[] = "interactive";
-    const char *s;
+
+  if (text) {
+    if (titles)
 #ifdef HAVE_GLUT
-    int w;
+      text_string(width - text_width(s) - 3, 4.0, s);
+#else
+      text_string(10.0, height - 10.0 - bp->font->ascent, s);
 #endif
-
-    if (interactive)
-      s = interactstr;
-    else
-      s = glc->next_model_s.name;
-
+    if (hud) hud_draw(height);
+    text_flush();
+  } else if (titles) {
 #ifdef HAVE_GLUT
-    {
-      unsigned int i = 0;
+    unsigned int i = 0;
+    int w = glutBitmapLength(GLUT_BITMAP_HELVETICA_12, (const unsigned char *)s);
 
-      w = glutBitmapLength(GLUT_BITMAP_HELVETICA_12, (const unsigned char *)s);
-      glRasterPos2f((GLfloat)(glc->width - w - 3), 4.0);
-      while (s[i] != '\0')
-        glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, s[i++]);
-    }
+    glRasterPos2f((GLfloat)(width - w - 3), 4.0);
+    while (s[i] != '\0')
+      glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, s[i++]);
 #else
-    print_gl_string(mi->dpy, bp->font, bp->font_list, mi->xgwa.width,
-                    mi->xgwa.height, 10.0, (float)mi->xgwa.height - 10.0, s);
+    print_gl_string(mi->dpy, bp->font, bp->font_list, width, height, 10.0,
+                    (float)height - 10.0, s);
 #endif
   }
+
   glPopMatrix();
   glMatrixMode(GL_PROJECTION);
   glPopMatrix();
-  glPopAttrib();
+  glMatrixMode(GL_MODELVIEW);
+  gls_enable(GLS_LIGHTING, was[GLS_LIGHTING]);
+  gls_enable(GLS_DEPTH_TEST, was[GLS_DEPTH_TEST]);
+  gls_enable(GLS_BLEND, was[GLS_BLEND]);
 }
 
-/* apply the matrix to the origin and stick it in vec */
-static void matmult_origin(float rotmat[16], float vec[4]) {
-#if 1
-  vec[0] = 0.5 * rotmat[0] + 0.5 * rotmat[4] + 0.5 * rotmat[8] + 1 * rotmat[12];
-  vec[1] = 0.5 * rotmat[1] + 0.5 * rotmat[5] + 0.5 * rotmat[9] + 1 * rotmat[13];
-  vec[2] =
-      0.5 * rotmat[2] + 0.5 * rotmat[6] + 0.5 * rotmat[10] + 1 * rotmat[14];
-  vec[3] =
-      0.5 * rotmat[3] + 0.5 * rotmat[7] + 0.5 * rotmat[11] + 1 * rotmat[15];
-#else
-  vec[0] = 0 * rotmat[0] + 0 * rotmat[1] + 0 * rotmat[2] + 1 * rotmat[3];
-  vec[1] = 0 * rotmat[4] + 0 * rotmat[5] + 0 * rotmat[6] + 1 * rotmat[7];
-  vec[2] = 0 * rotmat[8] + 0 * rotmat[9] + 0 * rotmat[10] + 1 * rotmat[11];
-  vec[3] = 0 * rotmat[12] + 0 * rotmat[13] + 0 * rotmat[14] + 1 * rotmat[15];
-#endif
-  vec[0] /= vec[3];
-  vec[1] /= vec[3];
-  vec[2] /= vec[3];
-  vec[3] = 1.0;
+/* Move the transform m from one node to the next, through a joint at the
+ * given fixed point angle.  This is the product of
+ *
+ *   glTranslatef(0.5, 0.5, 0.5);            move to center
+ *   glRotatef(90.0, 0.0, 0.0, -1.0);        reorient
+ *   glTranslatef(1.0 + explode, 0.0, 0.0);  move to new pos.
+ *   glRotatef(180.0 + ang, 1.0, 0.0, 0.0);  pivot to new angle
+ *   glTranslatef(-0.5, -0.5, -0.5);         return from center
+ *
+ * worked out by hand, so whole quarter turns come out exact. */
+static void node_step(float m[16], int angle, float gap) {
+  /* cos and sin of 180 degrees plus each quarter turn */
+  static const float quarter_cos[4] = {-1.0, 0.0, 1.0, 0.0};
+  static const float quarter_sin[4] = {0.0, -1.0, 0.0, 1.0};
+  float c, s, tx, ty, tz;
+  float c0[3], c1[3], c2[3];
+  int k;
+
+  if (angle & (ANGLE_ONE - 1)) {
+    double rad = angle * (M_PI / 2.0 / ANGLE_ONE);
+    c = -cos(rad);
+    s = -sin(rad);
+  } else {
+    c = quarter_cos[angle >> ANGLE_SHIFT];
+    s = quarter_sin[angle >> ANGLE_SHIFT];
+  }
+  tx = 0.5 * (1.0 - c + s);
+  ty = -gap;
+  tz = 0.5 * (1.0 - c - s);
+
+  for (k = 0; k < 3; k++) {
+    c0[k] = m[k];
+    c1[k] = m[4 + k];
+    c2[k] = m[8 + k];
+  }
+  for (k = 0; k < 3; k++) {
+    m[k] = -c1[k];
+    m[4 + k] = c * c0[k] + s * c2[k];
+    m[8 + k] = c * c2[k] - s * c0[k];
+    m[12 + k] += tx * c0[k] + ty * c1[k] + tz * c2[k];
+  }
+}
+
+/* Work out the transform of every node of a snake relative to the first
+ * one, by moving through the snake and performing the rotations, and the
+ * centre of mass of the whole thing.  gap is the explode distance.
+ *
+ * The centre of mass has always been taken over the places each joint
+ * leads to, that is the second node to one past the last, and over the
+ * corner each of those transforms puts at the origin, not the middle of
+ * the node.  The snake spins about it, so it stays that way. */
+static void snake_kinematics(const int *angle, float gap,
+                             float node_mat[][16], float com[3]) {
+  float m[16] = {1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0,
+                 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0};
+  int i, k;
+
+  com[0] = com[1] = com[2] = 0.0;
+  for (i = 0; i < NODE_COUNT; i++) {
+    memcpy(node_mat[i], m, sizeof(m));
+    node_step(m, angle[i], gap);
+    for (k = 0; k < 3; k++) com[k] += m[12 + k];
+  }
+  com[0] /= NODE_COUNT;
+  com[1] /= NODE_COUNT;
+  com[2] /= NODE_COUNT;
 }
 
 /* wot gets called when the winder is resized */
@@ -1697,17 +2867,21 @@ static int cross_product(int src_dir, int dst_dir) {
  *  is_cyclic = true if last node connects back to first node
  *  last_turn = for cyclic snakes, specifes what the 24th turn would be
  */
-static void calc_snake_metrics_shape(struct glsnake_shape *shape);
+static void calc_snake_metrics_shape(const struct glsnake_shape *shape,
+                                     struct snake_metrics *m);
 static void calc_snake_metrics_model_s(struct model_s *mdl);
 static void calc_snake_metrics(void) {
   calc_snake_metrics_model_s(&glc->next_model_s);
 }
 
 static void calc_snake_metrics_model_s(struct model_s *mdl) {
-  calc_snake_metrics_shape(&mdl->shape);
+  PROF_BEGIN(PROF_METRICS);
+  calc_snake_metrics_shape(&mdl->shape, &glc->metrics);
+  PROF_END(PROF_METRICS);
 }
 
-static void calc_snake_metrics_shape(struct glsnake_shape *shape) {
+static void calc_snake_metrics_shape(const struct glsnake_shape *shape,
+                                     struct snake_metrics *m) {
   int srcDir, dstDir;
   int i, x, y, z;
   int prevSrcDir = -Y_MASK;
@@ -1717,7 +2891,7 @@ static void calc_snake_metrics_shape(struct glsnake_shape *shape) {
   /* zero the grid */
   memset(&grid, 0, sizeof(int) * 25 * 25 * 25);
 
-  glc->is_legal = 1;
+  m->is_legal = 1;
   x = y = z = 12;
 
   /* trace path of snake - and keep record for is_legal */
@@ -1729,17 +2903,17 @@ static void calc_snake_metrics_shape(struct glsnake_shape *shape) {
     y += GETSCALAR(prevDstDir, Y_MASK);
     z += GETSCALAR(prevDstDir, Z_MASK);
 
-    switch ((int)shape->node[i]) {
-      case (int)(ZERO):
+    switch (shape->node[i]) {
+      case ZERO:
         dstDir = -prevSrcDir;
         break;
-      case (int)(PIN):
+      case PIN:
         dstDir = prevSrcDir;
         break;
-      case (int)(RIGHT):
-      case (int)(LEFT):
+      case RIGHT:
+      case LEFT:
         dstDir = cross_product(prevSrcDir, prevDstDir);
-        if (fabs(shape->node[i] - RIGHT) < FLT_EPSILON) dstDir = -dstDir;
+        if (shape->node[i] == RIGHT) dstDir = -dstDir;
         break;
       default:
         /* Prevent spurious "might be used
@@ -1754,29 +2928,29 @@ static void calc_snake_metrics_shape(struct glsnake_shape *shape) {
     else if (grid[x][y][z] + srcDir + dstDir == 0)
       grid[x][y][z] = 8;
     else
-      glc->is_legal = 0;
+      m->is_legal = 0;
 
     prevSrcDir = srcDir;
     prevDstDir = dstDir;
   }
 
   /* determine if the snake is cyclic */
-  glc->is_cyclic = (dstDir == Y_MASK && x == 12 && y == 11 && z == 12);
+  m->is_cyclic = (dstDir == Y_MASK && x == 12 && y == 11 && z == 12);
 
   /* determine last_turn */
-  glc->last_turn = -1;
-  if (glc->is_cyclic) switch (srcDir) {
+  m->last_turn = -1;
+  if (m->is_cyclic) switch (srcDir) {
       case -Z_MASK:
-        glc->last_turn = ZERO;
+        m->last_turn = ZERO;
         break;
       case Z_MASK:
-        glc->last_turn = PIN;
+        m->last_turn = PIN;
         break;
       case X_MASK:
-        glc->last_turn = LEFT;
+        m->last_turn = LEFT;
         break;
       case -X_MASK:
-        glc->last_turn = RIGHT;
+        m->last_turn = RIGHT;
         break;
     }
 }
@@ -1784,6 +2958,10 @@ static void calc_snake_metrics_shape(struct glsnake_shape *shape) {
 int spooky(void) {
   time_t t;
   struct tm *tm_p;
+#ifdef HAVE_GLUT
+  /* a session plays out on the day it was recorded */
+  if (session.latched) return session.spooky;
+#endif
   if ((t = time(NULL)) == -1) {
     return 0;
   }
@@ -1793,56 +2971,74 @@ int spooky(void) {
   return ((tm_p->tm_mon == 9 && tm_p->tm_mday == 31));
 }
 
-/* Work out how far through the current morph we are.  Used by morph_colour. */
-static float morph_percent(void) {
-  float retval;
-  int i;
+/* Returns the shortest rotation from one fixed point angle to another.
+ * Half turns go backwards, as they always have. */
+static inline int joint_delta(int from, int to) {
+  int d = (to - from) & ANGLE_MASK;
 
-  /* extend this function later with a case statement for each of the
-   * morph schemes */
+  return d < ANGLE_HALF ? d : d - ANGLE_FULL;
+}
 
-  /* when morphing all nodes at once, the longest morph will be the node
-   * that needs to rotate 180 degrees.  For each node, work out how far it
-   * has to go, and store the maximum rotation and current largest angular
-   * difference, returning the angular difference over the maximum. */
-  {
-    float rot_max = 0.0, ang_diff_max = 0.0;
+/* Step the joints of count snakes, stored one snake after another in
+ * angle[] and target[], at most step towards their targets.  Each snake's
+ * progress is worked out in the same pass from the largest rotation it has
+ * left, measured against the length of its whole morph in span[], and
+ * stored in percent[].  Returns the number of snakes still morphing.
+ *
+ * The inner loop is branch free and has a fixed trip count so that the
+ * compiler can vectorise it across joints. */
+static int morph_joints(int *angle, const unsigned char *target,
+                        const int *span, float *percent, int count, int step) {
+  int s, still_morphing = 0;
 
-    for (i = 0; i < NODE_COUNT - 1; i++) {
-      float rot, ang_diff;
+  for (s = 0; s < count; s++) {
+    int *a = angle + s * NODE_COUNT;
+    const unsigned char *t = target + s * NODE_COUNT;
+    int i, left = 0;
 
-      /* work out the maximum rotation this node has to go through
-       * from the previous to the next model, taking into account that
-       * the snake always morphs through the smaller angle */
-      rot = fabs(glc->prev_model_s.shape.node[i] -
-                 glc->next_model_s.shape.node[i]);
-      if (rot > 180.0) rot = 180.0 - rot;
-      /* work out the difference between the current position and the
-       * target */
-      ang_diff = fabs(glc->shape.node[i] - glc->next_model_s.shape.node[i]);
-      if (ang_diff > 180.0) ang_diff = 180.0 - ang_diff;
-      /* if it's the biggest so far, record it */
-      if (rot > rot_max) rot_max = rot;
-      if (ang_diff > ang_diff_max) ang_diff_max = ang_diff;
+    for (i = 0; i < NODE_COUNT; i++) {
+      int d = joint_delta(a[i], t[i] << ANGLE_SHIFT);
+      int r = d - MAX(-step, MIN(d, step));
+
+      a[i] = (a[i] + d - r) & ANGLE_MASK;
+      left = MAX(left, abs(r));
     }
 
-    /* ang_diff / rot approaches 0, we want the complement */
-    retval = 1.0 - (ang_diff_max / rot_max);
-/* protect against naan */
+    if (left >= span[s])
+      percent[s] = left ? 0.0 : 1.0;
+    else
+      percent[s] = 1.0 - (float)left / span[s];
+    still_morphing += left != 0;
+  }
+
+  return still_morphing;
+}
 
-/* Apparently some systems (Solaris) don't have isinf() */
-#undef isinf
-#define isinf(x) (((x) > 999999999999.9) || ((x) < -999999999999.9))
+/* Returns the largest rotation any joint has to make to reach its target */
+static int morph_span(const int *angle, const unsigned char *target) {
+  int i, span = 0;
 
-    if (isnan(retval) || isinf(retval)) retval = 1.0;
-  }
-  /*printf("morph_pct = %f\n", retval);*/
-  return retval;
+  for (i = 0; i < NODE_COUNT; i++)
+    span = MAX(span, abs(joint_delta(angle[i], target[i] << ANGLE_SHIFT)));
+
+  return span;
+}
+
+/* Note the largest rotation the morph that is starting has to make, so its
+ * progress can be measured against it. */
+static void measure_morph(void) {
+  glc->morph_span = morph_span(glc->shape.node, glc->next_model_s.shape.node);
+  glc->morph_progress = glc->morph_span ? 0.0 : 1.0;
 }
 
+/* Work out how far through the current morph we are.  Used by morph_colour.
+ * morph_all_at_once keeps this up to date as it steps the joints. */
+static float morph_percent(void) { return glc->morph_progress; }
+
 static void morph_colour(void) {
   float percent, compct; /* complement of percentage */
 
+  PROF_BEGIN(PROF_COLOUR);
   percent = glc->morph_percent();
   compct = 1.0 - percent;
 
@@ -1863,6 +3059,19 @@ static void morph_colour(void) {
                       colour[glc->next_colour][1][2] * percent;
   glc->colour[1][3] = colour[glc->prev_colour][1][3] * compct +
                       colour[glc->next_colour][1][3] * percent;
+  PROF_END(PROF_COLOUR);
+}
+
+/* choose the colour scheme for a shape with the given metrics */
+static int metrics_colour(const struct snake_metrics *m) {
+  if (!m->is_legal)
+    return COLOUR_INVALID;
+  else if (altcolour)
+    return spooky() ? COLOUR_SPOOKY : COLOUR_AUTHENTIC;
+  else if (m->is_cyclic)
+    return COLOUR_CYCLIC;
+  else
+    return COLOUR_ACYCLIC;
 }
 
 /* Start morph process to this model */
@@ -1877,7 +3086,8 @@ static void start_morph_shape(struct glsnake_shape *shape, int immediate) {
   if (immediate) {
     int i;
 
-    for (i = 0; i < NODE_COUNT; i++) glc->shape.node[i] = shape->node[i];
+    for (i = 0; i < NODE_COUNT; i++)
+      glc->shape.node[i] = shape->node[i] << ANGLE_SHIFT;
   }
 
   memcpy(&glc->prev_model_s, &glc->next_model_s, sizeof(struct model_s));
@@ -1886,18 +3096,7 @@ static void start_morph_shape(struct glsnake_shape *shape, int immediate) {
   glc->prev_colour = glc->next_colour;
 
   calc_snake_metrics();
-  if (!glc->is_legal)
-    glc->next_colour = COLOUR_INVALID;
-  else if (altcolour) {
-    if (spooky()) {
-      glc->next_colour = COLOUR_SPOOKY;
-    } else {
-      glc->next_colour = COLOUR_AUTHENTIC;
-    }
-  } else if (glc->is_cyclic)
-    glc->next_colour = COLOUR_CYCLIC;
-  else
-    glc->next_colour = COLOUR_ACYCLIC;
+  glc->next_colour = metrics_colour(&glc->metrics);
 
   if (immediate) {
     glc->colour[0][0] = colour[glc->next_colour][0][0];
@@ -1917,6 +3116,7 @@ static void start_morph_shape(struct glsnake_shape *shape, int immediate) {
     glc->new_morph = 1;
   }
   glc->morphing = 1;
+  measure_morph();
 
   morph_colour();
 }
@@ -1997,66 +3197,44 @@ void save_snake_state() {
 
 #ifdef HAVE_GLUT
 static void glsnake_idle();
-
-static void restore_idle(int v ATTRIBUTE_UNUSED) { glutIdleFunc(glsnake_idle); }
 #endif
 
-static void quick_sleep(void) {
-#ifdef HAVE_GLUT
-  /* By using glutTimerFunc we can keep responding to
-   * mouse and keyboard events, unlike using something like
-   * usleep. */
-  glutIdleFunc(NULL);
-  glutTimerFunc(5, restore_idle, 0);
-#else
-  usleep(1);
-#endif
+/* work out the largest rotation a joint may make in a timeslice
+ * iter_msec milliseconds long */
+static int morph_step(long iter_msec) {
+  int step = (int)(ANGLE_ONE * (angvel / 1000.0) * iter_msec);
+
+  return MAX(step, 1);
 }
 
 /* returns a flag indicating if any rotation happened */
-int rotate_joint(int current_node, float iter_angle_max) {
-  struct glsnake_shape *shape = &(glc->shape);
-  float cur_angle = shape->node[current_node];
-  float dest_angle = glc->next_model_s.shape.node[current_node];
-  int rotated = 0;
-
-  if (cur_angle != dest_angle) {
-    rotated = 1;
-  }
-  if (fabs(cur_angle - dest_angle) <= iter_angle_max)
-    shape->node[current_node] = dest_angle;
-  else if (fmod(cur_angle - dest_angle + 360, 360) > 180)
-    shape->node[current_node] = fmod(cur_angle + iter_angle_max, 360);
-  else
-    shape->node[current_node] = fmod(cur_angle + 360 - iter_angle_max, 360);
+int rotate_joint(int current_node, int step) {
+  int *angle = &glc->shape.node[current_node];
+  int d = joint_delta(*angle,
+                      glc->next_model_s.shape.node[current_node] << ANGLE_SHIFT);
 
-  return rotated;
+  *angle = (*angle + MAX(-step, MIN(d, step))) & ANGLE_MASK;
+
+  return d != 0;
 }
 
 /* returns a flag indicating if this morph is complete */
 static int morph_all_at_once(long iter_msec) {
-  int i, still_morphing = 0;
-  /* work out the maximum angle we could turn this node in this
-   * timeslice, iter_msec milliseconds long */
-  float iter_angle_max = 90.0 * (angvel / 1000.0) * iter_msec;
-
-  for (i = 0; i < NODE_COUNT; i++) {
-    int rotated = rotate_joint(i, iter_angle_max);
-    if (rotated) {
-      still_morphing = 1;
-    }
+  if (glc->new_morph) {
+    measure_morph();
+    glc->new_morph = 0;
   }
-  return still_morphing;
+
+  return morph_joints(glc->shape.node, glc->next_model_s.shape.node,
+                      &glc->morph_span, &glc->morph_progress, 1,
+                      morph_step(iter_msec));
 }
 
 static int morph_one_at_time_current_node = 0;
 
 static int morph_one_at_a_time(long iter_msec) {
   int current_node = morph_one_at_time_current_node;
-  struct glsnake_shape *shape = &(glc->shape);
-  /* work out the maximum angle we could turn this node in this
-   * timeslice, iter_msec milliseconds long */
-  float iter_angle_max = 90.0 * (angvel / 1000.0) * iter_msec;
+  struct glsnake_pose *shape = &(glc->shape);
 
   if (glc->new_morph) {
     current_node = morph_one_at_time_current_node = 0;
@@ -2065,7 +3243,7 @@ static int morph_one_at_a_time(long iter_msec) {
 
   /* find the next angle (possibly the current one) to rotate */
   while (shape->node[current_node] ==
-         glc->next_model_s.shape.node[current_node]) {
+         glc->next_model_s.shape.node[current_node] << ANGLE_SHIFT) {
     current_node++;
     if (current_node == NODE_COUNT) {
       /* all joints are at their destination, so we're done morphing */
@@ -2075,280 +3253,4335 @@ static int morph_one_at_a_time(long iter_msec) {
   }
   morph_one_at_time_current_node = current_node;
 
-  rotate_joint(current_node, iter_angle_max);
+  rotate_joint(current_node, morph_step(iter_msec));
 
   return 1;
 }
 
 static float morph_percent_one_at_a_time(void) {
-  return morph_one_at_time_current_node / NODE_COUNT;
+  return (float)morph_one_at_time_current_node / NODE_COUNT;
 }
 
-void glsnake_idle(
-#ifndef HAVE_GLUT
-    struct glsnake_cfg *bp
-#endif
-) {
-  /* time since last iteration */
-  long iter_msec;
-  /* time since the beginning of last morph */
-  long morf_msec;
-  snaketime current_time;
-  int still_morphing;
+/*
+ * SCENES OF MANY SNAKES
+ */
 
-  /* Do nothing to the model if we are paused */
-  if (glc->paused) {
-    /* Avoid busy waiting when nothing is changing */
-    quick_sleep();
-#ifdef HAVE_GLUT
-    glutPostRedisplay();
+/* distance between neighbouring snakes in a scene */
+#define SCENE_SPACING 9.0
+
+static void scene_free(struct snake_scene *sc) {
+  free(sc->angle);
+  free(sc->target);
+  free(sc->span);
+  free(sc->progress);
+  free(sc->rest);
+  free(sc->scheme);
+  free(sc->colour);
+  free(sc->place);
+  free(sc->posed);
+  free(sc->node_mat);
+  free(sc->com);
+  free(sc->bounds);
+  free(sc->cell);
+  free(sc->head);
+  free(sc->next);
+  free(sc->centre);
+  free(sc->extent);
+  free(sc->radius);
+  free(sc->order);
+  free(sc->depth);
+  free(sc->lod);
+  free(sc->node_order);
+  free(sc->node_depth);
+#ifdef GL_VERSION_1_5
+  if (sc->query && sc->query[0]) glDeleteQueries(sc->count, sc->query);
 #endif
-    return;
-  }
+  free(sc->query);
+  free(sc->pending);
+  free(sc->hidden);
+  free(sc);
+}
 
-  /* <spiv> Well, ftime gives time with millisecond resolution.
-   * <spiv> (or worse, perhaps... who knows what the OS will do)
-   * <spiv> So if no discernable amount of time has passed:
-   * <spiv>   a) There's no point updating the screen, because
-   *             it would be the same
-   * <spiv>   b) The code will divide by zero
-   */
-  gettime(&current_time);
+/*
+ * Collisions between the snakes of a scene.  The broad phase keeps every
+ * snake in a uniform grid by its place, and a box around its target shape.
+ * Only snakes in the grid cells a box could reach are looked at, so
+ * planning a morph costs about the same however big the scene gets.  The
+ * narrow phase then tests the prisms of the two snakes against each other.
+ */
 
-  iter_msec =
-      (long)GETMSECS(current_time) - GETMSECS(glc->last_iteration) +
-      ((long)GETSECS(current_time) - GETSECS(glc->last_iteration)) * 1000L;
+/* a sphere of this radius about the centre of a node holds all of it */
+#define NODE_RADIUS 0.8660254
 
-  if (iter_msec) {
-    /* save the current time */
-    memcpy(&glc->last_iteration, &current_time, sizeof(snaketime));
+/* how far two prisms may overlap before they collide */
+#define PRISM_SLOP 0.05
 
-    /* work out if we have to switch models */
-    morf_msec =
-        GETMSECS(glc->last_iteration) - GETMSECS(glc->last_morph) +
-        ((long)(GETSECS(glc->last_iteration) - GETSECS(glc->last_morph)) *
-         1000L);
+/* how many morph targets to try before giving up on moving a snake */
+#define SCENE_PLAN_TRIES 8
 
-    if ((morf_msec > statictime) && !interactive && !glc->morphing) {
-      /*printf("starting morph\n");*/
-      memcpy(&glc->last_morph, &(glc->last_iteration), sizeof(glc->last_morph));
-      start_morph(RAND(models), 0);
-    }
+/* the grid cell a coordinate in the scene falls in */
+static int grid_coord(float x) {
+  double cell = floor(x / SCENE_SPACING + 0.5);
 
-    if (interactive && !glc->morphing) {
-      quick_sleep();
-      return;
-    }
+  return (int)cell;
+}
 
-    /*	if (!glc->dragging && !glc->interactive) { */
-    if (!interactive) {
-      yspin += 360 / ((1000 / yangvel) / iter_msec);
-      zspin += 360 / ((1000 / zangvel) / iter_msec);
-      /*
-      yspin += 360 * (yangvel/1000.0) * iter_msec;
-      zspin += 360 * (zangvel/1000.0) * iter_msec;
-      */
+static int grid_bucket(const struct snake_scene *sc, const int *cell) {
+  return ((unsigned int)cell[0] * 73856093U ^ (unsigned int)cell[1] * 19349663U ^
+          (unsigned int)cell[2] * 83492791U) & (sc->buckets - 1);
+}
 
-      /*printf("yspin: %f, zspin: %f\n", yspin, zspin);*/
-    }
+/* file snake s in the grid under the cell its place falls in */
+static void grid_insert(struct snake_scene *sc, int s) {
+  int k, b;
 
-    still_morphing = glc->morph(iter_msec);
+  for (k = 0; k < 3; k++)
+    sc->cell[s][k] = grid_coord(sc->place[s][k]);
+  b = grid_bucket(sc, sc->cell[s]);
+  sc->next[s] = sc->head[b];
+  sc->head[b] = s;
+}
 
-    if (!still_morphing) {
-      glc->morphing = 0;
-    }
+/* work out where the nodes of snake s would be in the scene if it took on
+ * the target shape, and the box around them */
+static void target_pose(const struct snake_scene *sc, int s,
+                        const unsigned char *target, float node_mat[][16],
+                        float bounds[2][3]) {
+  int angle[NODE_COUNT];
+  float com[3];
+  int i, k;
+
+  for (i = 0; i < NODE_COUNT; i++) angle[i] = target[i] << ANGLE_SHIFT;
+  snake_kinematics(angle, explode, node_mat, com);
+
+  for (k = 0; k < 3; k++) {
+    bounds[0][k] = FLT_MAX;
+    bounds[1][k] = -FLT_MAX;
+  }
+  for (i = 0; i < NODE_COUNT; i++) {
+    float *m = node_mat[i];
 
-    /* colour cycling */
-    morph_colour();
+    for (k = 0; k < 3; k++) {
+      float c;
 
-#ifdef HAVE_GLUT
-    glutPostRedisplay();
-#endif
-  } else {
-    /* We are going too fast, so we may as well let the
-     * cpu relax a little by sleeping for a millisecond. */
-    quick_sleep();
+      m[12 + k] += sc->place[s][k] - com[k];
+      c = 0.5 * (m[k] + m[4 + k] + m[8 + k]) + m[12 + k];
+      bounds[0][k] = MIN(bounds[0][k], c - NODE_RADIUS);
+      bounds[1][k] = MAX(bounds[1][k], c + NODE_RADIUS);
+    }
   }
 }
 
-/* wot draws it */
-void glsnake_display(
-#ifndef HAVE_GLUT
-    ModeInfo *mi
-#endif
-) {
-#ifndef HAVE_GLUT
-  struct glsnake_cfg *bp = &glc[MI_SCREEN(mi)];
-  Display *dpy = MI_DISPLAY(mi);
-  Window window = MI_WINDOW(mi);
-#endif
-  int i;
-  float ang;
-  float positions[NODE_COUNT][4]; /* origin points for each node */
-  float com[4];                   /* it's the CENTRE of MASS */
-
-#ifndef HAVE_GLUT
-  if (!bp->glx_context) return;
-#endif
+/* Separating axis test between two node prisms, using the corners from
+ * solid_prism_v.  The bevel makes the long face bulge out a little, so
+ * prisms have to overlap by more than PRISM_SLOP to count; two that only
+ * touch face to face, like a pair making up a cube, don't. */
+static int prisms_overlap(const float *a, const float *b) {
+  /* face normals and edge directions of the prism, which share axes */
+  static const float local_axis[4][3] = {{1.0, 0.0, 0.0},
+                                         {0.0, 1.0, 0.0},
+                                         {0.0, 0.0, 1.0},
+                                         {M_SQRT1_2, -M_SQRT1_2, 0.0}};
+  const int corners = sizeof(solid_prism_v) / sizeof(solid_prism_v[0]);
+  float va[sizeof(solid_prism_v) / sizeof(solid_prism_v[0])][3];
+  float vb[sizeof(solid_prism_v) / sizeof(solid_prism_v[0])][3];
+  float axis_a[4][3], axis_b[4][3], axis[24][3];
+  int axes = 0, i, j, k;
+
+  for (i = 0; i < corners; i++)
+    for (k = 0; k < 3; k++) {
+      const float *v = solid_prism_v[i];
+
+      va[i][k] = a[k] * v[0] + a[4 + k] * v[1] + a[8 + k] * v[2] + a[12 + k];
+      vb[i][k] = b[k] * v[0] + b[4 + k] * v[1] + b[8 + k] * v[2] + b[12 + k];
+    }
 
-  /* clear the buffer */
-  glClear((GLbitfield)GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  for (i = 0; i < 4; i++)
+    for (k = 0; k < 3; k++) {
+      const float *l = local_axis[i];
 
-  /* go into the modelview stack */
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
+      axis_a[i][k] = a[k] * l[0] + a[4 + k] * l[1] + a[8 + k] * l[2];
+      axis_b[i][k] = b[k] * l[0] + b[4 + k] * l[1] + b[8 + k] * l[2];
+    }
 
-  /* get the centre of each node, by moving through the snake and
-   * performing the rotations, then grabbing the matrix at each point
-   * and applying it to the origin */
-  glPushMatrix();
+  for (i = 0; i < 4; i++) {
+    memcpy(axis[axes++], axis_a[i], sizeof(axis_a[i]));
+    memcpy(axis[axes++], axis_b[i], sizeof(axis_b[i]));
+  }
+  for (i = 0; i < 4; i++)
+    for (j = 0; j < 4; j++) {
+      float *n = axis[axes];
+
+      n[0] = axis_a[i][1] * axis_b[j][2] - axis_a[i][2] * axis_b[j][1];
+      n[1] = axis_a[i][2] * axis_b[j][0] - axis_a[i][0] * axis_b[j][2];
+      n[2] = axis_a[i][0] * axis_b[j][1] - axis_a[i][1] * axis_b[j][0];
+      /* parallel edges don't give an axis */
+      if (n[0] * n[0] + n[1] * n[1] + n[2] * n[2] > 1e-6) axes++;
+    }
 
-#ifdef HAVE_GLUT
-  /* apply the mouse drag rotation */
-  ui_mousedrag();
-#endif
+  for (i = 0; i < axes; i++) {
+    const float *n = axis[i];
+    float min_a = FLT_MAX, max_a = -FLT_MAX;
+    float min_b = FLT_MAX, max_b = -FLT_MAX;
 
-  /* apply the continuous rotation */
-  glRotatef(yspin, 0.0, 1.0, 0.0);
-  glRotatef(zspin, 0.0, 0.0, 1.0);
+    for (j = 0; j < corners; j++) {
+      float pa = n[0] * va[j][0] + n[1] * va[j][1] + n[2] * va[j][2];
+      float pb = n[0] * vb[j][0] + n[1] * vb[j][1] + n[2] * vb[j][2];
 
-  com[0] = 0.0;
-  com[1] = 0.0;
-  com[2] = 0.0;
-  com[3] = 0.0;
-  for (i = 0; i < NODE_COUNT; i++) {
-    float rotmat[16];
+      min_a = MIN(min_a, pa);
+      max_a = MAX(max_a, pa);
+      min_b = MIN(min_b, pb);
+      max_b = MAX(max_b, pb);
+    }
+    if (max_a - min_b < PRISM_SLOP || max_b - min_a < PRISM_SLOP) return 0;
+  }
 
-    ang = glc->shape.node[i];
+  return 1;
+}
 
-    /*printf("ang = %f\n", ang);*/
+/* narrow phase: do any prisms of two posed snakes overlap? */
+static int snakes_overlap(float a[][16], const float a_bounds[2][3],
+                          float b[][16], const float b_bounds[2][3]) {
+  int near_a[NODE_COUNT], near_b[NODE_COUNT];
+  float centre_a[NODE_COUNT][3], centre_b[NODE_COUNT][3];
+  int count_a = 0, count_b = 0;
+  int i, j, k;
 
-    glTranslatef(0.5, 0.5, 0.5);           /* move to center */
-    glRotatef(90.0, 0.0, 0.0, -1.0);       /* reorient  */
-    glTranslatef(1.0 + explode, 0.0, 0.0); /* move to new pos. */
-    glRotatef(180.0 + ang, 1.0, 0.0, 0.0); /* pivot to new angle */
-    glTranslatef(-0.5, -0.5, -0.5);        /* return from center */
+  /* only nodes inside the other snake's box can hit it */
+  for (i = 0; i < NODE_COUNT; i++) {
+    float ca[3], cb[3];
+    int in_a = 1, in_b = 1;
+
+    for (k = 0; k < 3; k++) {
+      ca[k] = 0.5 * (a[i][k] + a[i][4 + k] + a[i][8 + k]) + a[i][12 + k];
+      cb[k] = 0.5 * (b[i][k] + b[i][4 + k] + b[i][8 + k]) + b[i][12 + k];
+      in_a &= ca[k] + NODE_RADIUS > b_bounds[0][k] &&
+              ca[k] - NODE_RADIUS < b_bounds[1][k];
+      in_b &= cb[k] + NODE_RADIUS > a_bounds[0][k] &&
+              cb[k] - NODE_RADIUS < a_bounds[1][k];
+    }
+    if (in_a) {
+      memcpy(centre_a[count_a], ca, sizeof(ca));
+      near_a[count_a++] = i;
+    }
+    if (in_b) {
+      memcpy(centre_b[count_b], cb, sizeof(cb));
+      near_b[count_b++] = i;
+    }
+  }
 
-    glGetFloatv(GL_MODELVIEW_MATRIX, rotmat);
+  for (i = 0; i < count_a; i++)
+    for (j = 0; j < count_b; j++) {
+      float d[3];
 
-    matmult_origin(rotmat, positions[i]);
+      for (k = 0; k < 3; k++) d[k] = centre_a[i][k] - centre_b[j][k];
+      if (d[0] * d[0] + d[1] * d[1] + d[2] * d[2] >=
+          4.0 * NODE_RADIUS * NODE_RADIUS)
+        continue;
+      if (prisms_overlap(a[near_a[i]], b[near_b[j]])) return 1;
+    }
 
-    /*printf("positions %f %f %f %f\n", positions[i][0], positions[i][1],
-     * positions[i][2], positions[i][3]);*/
+  return 0;
+}
 
-    com[0] += positions[i][0];
-    com[1] += positions[i][1];
-    com[2] += positions[i][2];
-    com[3] += positions[i][3];
+/* Would snake s collide with its neighbours' targets if it took on this
+ * target shape?  Snakes not yet in the grid are ignored. */
+static int scene_collides(const struct snake_scene *sc, int s,
+                          const unsigned char *target) {
+  float node_mat[NODE_COUNT][16], bounds[2][3];
+  float other_mat[NODE_COUNT][16], other_bounds[2][3];
+  int lo[3], hi[3], cell[3];
+  int k;
+
+  target_pose(sc, s, target, node_mat, bounds);
+
+  /* any snake whose box could reach this one is filed under these cells */
+  for (k = 0; k < 3; k++) {
+    lo[k] = grid_coord(bounds[0][k] - sc->reach);
+    hi[k] = grid_coord(bounds[1][k] + sc->reach);
   }
-  glPopMatrix();
-  com[0] /= NODE_COUNT;
-  com[1] /= NODE_COUNT;
-  com[2] /= NODE_COUNT;
-  com[3] /= NODE_COUNT;
 
-  com[0] /= com[3];
-  com[1] /= com[3];
-  com[2] /= com[3];
+  for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+    for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+      for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++) {
+        int t;
+
+        for (t = sc->head[grid_bucket(sc, cell)]; t != -1; t = sc->next[t]) {
+          if (t == s || memcmp(sc->cell[t], cell, sizeof(cell))) continue;
+          for (k = 0; k < 3; k++)
+            if (bounds[1][k] <= sc->bounds[t][0][k] ||
+                sc->bounds[t][1][k] <= bounds[0][k])
+              break;
+          if (k < 3) continue;
+
+          target_pose(sc, t, sc->target + t * NODE_COUNT, other_mat,
+                      other_bounds);
+          if (snakes_overlap(node_mat, bounds, other_mat, other_bounds))
+            return 1;
+        }
+      }
 
-  /*printf("com: %f, %f, %f, %f\n", com[0], com[1], com[2], com[3]);*/
+  return 0;
+}
 
-#if MAGICAL_RED_STRING
-  glPushMatrix();
-  glTranslatef(-com[0], -com[1], -com[2]);
+/* note the box around the target of snake s, for the broad phase */
+static void scene_bound(struct snake_scene *sc, int s) {
+  float node_mat[NODE_COUNT][16];
+  int k;
 
-  glDisable(GL_LIGHTING);
-  glColor4f(1.0, 0.0, 0.0, 1.0);
-  glBegin(GL_LINE_STRIP);
-  for (i = 0; i < NODE_COUNT - 1; i++) {
-    glVertex3fv(positions[i]);
+  target_pose(sc, s, sc->target + s * NODE_COUNT, node_mat, sc->bounds[s]);
+  for (k = 0; k < 3; k++) {
+    sc->reach = MAX(sc->reach, sc->place[s][k] - sc->bounds[s][0][k]);
+    sc->reach = MAX(sc->reach, sc->bounds[s][1][k] - sc->place[s][k]);
   }
-  glEnd();
-  glEnable(GL_LIGHTING);
-  /*glTranslatef(com[0], com[1], com[2]);*/
-  glPopMatrix();
-#endif
+}
 
-  glPushMatrix();
-  glTranslatef(-com[0], -com[1], -com[2]);
+/* Start snake s of the scene morphing to a new shape */
+static void scene_morph(struct snake_scene *sc, int s,
+                        const struct glsnake_shape *shape, int immediate) {
+  int *angle = sc->angle + s * NODE_COUNT;
+  unsigned char *target = sc->target + s * NODE_COUNT;
+  struct snake_metrics metrics;
+  int i;
 
-#ifdef HAVE_GLUT
-  /* apply the mouse drag rotation */
-  ui_mousedrag();
-#endif
+  memcpy(target, shape->node, NODE_COUNT);
+  if (immediate)
+    for (i = 0; i < NODE_COUNT; i++) angle[i] = target[i] << ANGLE_SHIFT;
 
-  /* apply the continuous rotation */
-  glRotatef(yspin, 0.0, 1.0, 0.0);
-  glRotatef(zspin, 0.0, 0.0, 1.0);
+  PROF_BEGIN(PROF_METRICS);
+  calc_snake_metrics_shape(shape, &metrics);
+  PROF_END(PROF_METRICS);
+  sc->scheme[s][0] = immediate ? metrics_colour(&metrics) : sc->scheme[s][1];
+  sc->scheme[s][1] = metrics_colour(&metrics);
 
-  /* now draw each node along the snake -- this is quite ugly :p */
-  for (i = 0; i < NODE_COUNT; i++) {
-    /* choose a colour for this node */
-    if ((i == glc->selected || i == glc->selected + 1) && interactive)
-      if (wireframe) {
-        glColor4fv(yellow_light);
-      } else {
-        glMaterialfv(GL_FRONT, GL_DIFFUSE, yellow_light);
-      }
-    else {
-      if (wireframe) {
-        glColor4fv(glc->colour[(i + 1) % 2]);
-      } else {
-        glMaterialfv(GL_FRONT, GL_AMBIENT, glc->colour[(i + 1) % 2]);
-        glMaterialfv(GL_FRONT, GL_DIFFUSE, glc->colour[(i + 1) % 2]);
-        /*glMaterialfv(GL_FRONT, GL_SPECULAR, glc->colour[(i+1)%2]);*/
-      }
-    }
+  sc->span[s] = morph_span(angle, target);
+  sc->progress[s] = sc->span[s] ? 0.0 : 1.0;
+  sc->rest[s] = statictime;
+  scene_bound(sc, s);
+}
 
-    /* draw the node */
-    if (wireframe)
-      glCallList(glc->node_wire);
-    else
-      glCallList(glc->node_solid);
+/* Pick a new shape for snake s that won't run into its neighbours, and
+ * start morphing to it.  If none of the shapes tried fit, the snake stays
+ * as it is for a while. */
+static void scene_plan(struct snake_scene *sc, int s, int immediate) {
+  const struct glsnake_shape *straight = &builtin_model[STRAIGHT_MODEL].shape;
+  int tries;
 
-    /* now work out where to draw the next one */
+  for (tries = 0; tries < SCENE_PLAN_TRIES; tries++) {
+    const struct glsnake_shape *shape = &model[RAND(models)].shape;
 
-    /* Interpolate between models */
-    ang = glc->shape.node[i];
+    if (!scene_collides(sc, s, shape->node)) {
+      scene_morph(sc, s, shape, immediate);
+      if (tries) sc->replanned++;
+      return;
+    }
+  }
+
+  sc->rejected++;
+  sc->rest[s] = statictime;
+  /* A new snake has to take on some shape, so it gets the straight one if
+   * that fits.  If not, it keeps the ball scene_new gave it, which stays
+   * well inside its own cell, and which everything since has fitted
+   * round. */
+  if (immediate && !scene_collides(sc, s, straight->node))
+    scene_morph(sc, s, straight, 1);
+}
 
-    glTranslatef(0.5, 0.5, 0.5);           /* move to center */
-    glRotatef(90.0, 0.0, 0.0, -1.0);       /* reorient  */
-    glTranslatef(1.0 + explode, 0.0, 0.0); /* move to new pos. */
-    glRotatef(180.0 + ang, 1.0, 0.0, 0.0); /* pivot to new angle */
-    glTranslatef(-0.5, -0.5, -0.5);        /* return from center */
+static struct snake_scene *scene_new(int count) {
+  struct snake_scene *sc;
+  int s;
+
+  if ((sc = calloc(1, sizeof(struct snake_scene))) == NULL) return NULL;
+
+  sc->count = count;
+  sc->angle = calloc(count * NODE_COUNT, sizeof(int));
+  sc->target = calloc(count * NODE_COUNT, sizeof(unsigned char));
+  sc->span = calloc(count, sizeof(int));
+  sc->progress = calloc(count, sizeof(float));
+  sc->rest = calloc(count, sizeof(long));
+  sc->scheme = calloc(count, sizeof(*sc->scheme));
+  sc->colour = calloc(count, sizeof(*sc->colour));
+  sc->place = calloc(count, sizeof(*sc->place));
+  sc->posed = calloc(count, sizeof(unsigned int));
+  sc->node_mat = calloc(count, sizeof(*sc->node_mat));
+  sc->com = calloc(count, sizeof(*sc->com));
+  sc->bounds = calloc(count, sizeof(*sc->bounds));
+  sc->cell = calloc(count, sizeof(*sc->cell));
+  for (sc->buckets = 1; sc->buckets < 2 * count; sc->buckets *= 2)
+    ;
+  sc->head = malloc(sc->buckets * sizeof(int));
+  sc->next = calloc(count, sizeof(int));
+  sc->centre = calloc(count, sizeof(*sc->centre));
+  sc->extent = calloc(count, sizeof(*sc->extent));
+  sc->radius = calloc(count, sizeof(float));
+  sc->order = calloc(count, sizeof(int));
+  sc->depth = calloc(count, sizeof(float));
+  sc->lod = calloc(count, sizeof(*sc->lod));
+  sc->node_order = calloc(count * NODE_COUNT, sizeof(int));
+  sc->node_depth = calloc(count * NODE_COUNT, sizeof(float));
+  sc->query = calloc(count, sizeof(GLuint));
+  sc->pending = calloc(count, sizeof(int));
+  sc->hidden = calloc(count, sizeof(int));
+  if (!sc->angle || !sc->target || !sc->span || !sc->progress || !sc->rest ||
+      !sc->scheme || !sc->colour || !sc->place || !sc->posed ||
+      !sc->node_mat || !sc->com || !sc->bounds || !sc->cell || !sc->head ||
+      !sc->next || !sc->centre || !sc->extent || !sc->radius || !sc->order ||
+      !sc->depth || !sc->lod || !sc->node_order || !sc->node_depth ||
+      !sc->query || !sc->pending || !sc->hidden) {
+    scene_free(sc);
+    return NULL;
+  }
+  memset(sc->head, -1, sc->buckets * sizeof(int));
+
+  /* stack the snakes in a cube, centred on the origin, each curled up in
+   * a ball to begin with so that they can't touch */
+  for (sc->size = 1; sc->size * sc->size * sc->size < count; sc->size++)
+    ;
+  for (s = 0; s < count; s++) {
+    float centre = (sc->size - 1) / 2.0;
+
+    sc->place[s][0] = (s % sc->size - centre) * SCENE_SPACING;
+    sc->place[s][1] = (s / sc->size % sc->size - centre) * SCENE_SPACING;
+    sc->place[s][2] = (s / (sc->size * sc->size) - centre) * SCENE_SPACING;
+    sc->order[s] = s;
+
+    scene_morph(sc, s, &builtin_model[BALL_MODEL].shape, 1);
+    grid_insert(sc, s);
   }
+  for (s = 0; s < count; s++) {
+    scene_plan(sc, s, 1);
+    /* stagger the morphs so the snakes don't all move at once */
+    sc->rest[s] = RAND(statictime + 1);
+  }
+  sc->gap = -1.0;
 
-  glPopMatrix();
+  return sc;
+}
 
-  if (titles)
-#ifdef HAVE_GLUT
-    draw_title();
-#else
-    draw_title(mi);
-#endif
+/* advance every snake in the scene by iter_msec milliseconds */
+static void scene_idle(long iter_msec) {
+  struct snake_scene *sc = scene;
+  int s, k;
 
-#ifndef HAVE_GLUT
-  glsnake_idle(bp);
+  morph_joints(sc->angle, sc->target, sc->span, sc->progress, sc->count,
+               morph_step(iter_msec));
+
+  for (s = 0; s < sc->count; s++) {
+    float percent = sc->progress[s], compct = 1.0 - percent;
+    float(*from)[4] = colour[sc->scheme[s][0]];
+    float(*to)[4] = colour[sc->scheme[s][1]];
+
+    /* colour cycling */
+    for (k = 0; k < 4; k++) {
+      sc->colour[s][0][k] = from[0][k] * compct + to[0][k] * percent;
+      sc->colour[s][1][k] = from[1][k] * compct + to[1][k] * percent;
+    }
+
+    if (percent < 1.0 || interactive) continue;
+    sc->rest[s] -= iter_msec;
+    if (sc->rest[s] <= 0) scene_plan(sc, s, 0);
+  }
+}
+
+/*
+ * Culling.  Every node and snake gets a bounding sphere from its transform,
+ * and those are checked against the planes of the view frustum.  A snake
+ * wholly inside is drawn without looking at its nodes, and one wholly
+ * outside is skipped.  In a scene, occlusion queries can also skip snakes
+ * hidden behind nearer ones.
+ */
+
+#define FRUSTUM_OUT 0
+#define FRUSTUM_PART 1
+#define FRUSTUM_IN 2
+
+struct frustum {
+  float plane[6][4]; /* pointing inwards, normalised */
+  float depth[4];    /* distance in front of the eye */
+  float pixels;      /* pixels across a unit at unit distance */
+};
+
+/* what the renderer drew at each level of detail, and left out, for
+ * benchmark mode */
+static struct {
+  long drawn[LOD_LEVELS], culled, occluded;
+} cull;
+
+/* Nanoseconds spent on transparency, for benchmark mode.  This is wall
+ * clock time on the thread drawing, as clock() would count the time
+ * every other thread spent too. */
+static long long transparency_cost;
+
+/* Pull the frustum planes out of the current projection and modelview
+ * matrices, so they are in the coordinates of whatever is drawn next */
+static void frustum_get(struct frustum *f) {
+  float proj[16], view[16], clip[16];
+  GLint viewport[4];
+  int r, c, k;
+
+  glGetFloatv(GL_PROJECTION_MATRIX, proj);
+  glGetFloatv(GL_MODELVIEW_MATRIX, view);
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  for (c = 0; c < 4; c++)
+    for (r = 0; r < 4; r++) {
+      clip[c * 4 + r] = 0.0;
+      for (k = 0; k < 4; k++)
+        clip[c * 4 + r] += proj[k * 4 + r] * view[c * 4 + k];
+    }
+
+  /* The clip w row is the distance in front of the eye.  Everything else
+   * only rotates and scales evenly, so the length of that row is the
+   * scale, and that of the projection's y row is the cotangent of half
+   * the field of view. */
+  for (c = 0; c < 4; c++) f->depth[c] = clip[c * 4 + 3];
+  f->pixels = sqrt(proj[1] * proj[1] + proj[5] * proj[5] + proj[9] * proj[9]) *
+              sqrt(clip[3] * clip[3] + clip[7] * clip[7] + clip[11] * clip[11]) *
+              viewport[3] / 2.0;
+
+  /* left, right, bottom, top, near, far */
+  for (k = 0; k < 6; k++) {
+    float sign = k % 2 ? -1.0 : 1.0, len;
+
+    for (c = 0; c < 4; c++)
+      f->plane[k][c] = clip[c * 4 + 3] + sign * clip[c * 4 + k / 2];
+    len = sqrt(f->plane[k][0] * f->plane[k][0] +
+               f->plane[k][1] * f->plane[k][1] +
+               f->plane[k][2] * f->plane[k][2]);
+    for (c = 0; c < 4; c++) f->plane[k][c] /= len;
+  }
+}
+
+/* how far in front of the eye a point is */
+static float frustum_depth(const struct frustum *f, const float *p) {
+  return f->depth[0] * p[0] + f->depth[1] * p[1] + f->depth[2] * p[2] +
+         f->depth[3];
+}
+
+/* where a sphere lies against the frustum */
+static int frustum_sphere(const struct frustum *f, const float *centre,
+                          float radius) {
+  int result = FRUSTUM_IN;
+  int k;
+
+  for (k = 0; k < 6; k++) {
+    float d = f->plane[k][0] * centre[0] + f->plane[k][1] * centre[1] +
+              f->plane[k][2] * centre[2] + f->plane[k][3];
+
+    if (d < -radius) return FRUSTUM_OUT;
+    if (d < radius) result = FRUSTUM_PART;
+  }
+
+  return result;
+}
+
+/* Work out the middle of each node of a posed snake, and the box and the
+ * sphere about the centre of mass holding all of it, relative to the
+ * centre of mass */
+static void snake_extent(float node_mat[][16], const float *com,
+                         float centre[][3], float box[2][3], float *radius) {
+  float far2 = 0.0;
+  int i, k;
+
+  for (k = 0; k < 3; k++) {
+    box[0][k] = FLT_MAX;
+    box[1][k] = -FLT_MAX;
+  }
+  for (i = 0; i < NODE_COUNT; i++) {
+    const float *m = node_mat[i];
+    float d2 = 0.0;
+
+    for (k = 0; k < 3; k++) {
+      centre[i][k] = 0.5 * (m[k] + m[4 + k] + m[8 + k]) + m[12 + k] - com[k];
+      box[0][k] = MIN(box[0][k], centre[i][k] - NODE_RADIUS);
+      box[1][k] = MAX(box[1][k], centre[i][k] + NODE_RADIUS);
+      d2 += centre[i][k] * centre[i][k];
+    }
+    far2 = MAX(far2, d2);
+  }
+  *radius = sqrt(far2) + NODE_RADIUS;
+}
+
+/* Choose the level of detail to draw node i of a snake at, from how big it
+ * is on screen, or LOD_CULLED if it is out of view.  offset takes the node
+ * centres into the frustum's coordinates, and lod[] holds the level each
+ * node was drawn at last. */
+static int node_detail(const struct frustum *f, int snake_in,
+                       float centre[][3], const float *offset, int i,
+                       unsigned char *lod) {
+  static const float limit[LOD_LEVELS - 1] = {LOD_PLAIN_PIXELS,
+                                              LOD_POINT_PIXELS};
+  float c[3], depth, pixels;
+  int k;
+
+  for (k = 0; k < 3; k++) c[k] = centre[i][k] + offset[k];
+  if (snake_in != FRUSTUM_IN &&
+      frustum_sphere(f, c, NODE_RADIUS) == FRUSTUM_OUT) {
+    cull.culled++;
+    return LOD_CULLED;
+  }
+
+  depth = frustum_depth(f, c);
+  pixels = depth > 0.0 ? NODE_RADIUS * f->pixels / depth : FLT_MAX;
+  while (lod[i] > LOD_FULL &&
+         pixels > limit[lod[i] - 1] * (1.0 + LOD_HYSTERESIS))
+    lod[i]--;
+  while (lod[i] < LOD_POINT && pixels < limit[lod[i]] * (1.0 - LOD_HYSTERESIS))
+    lod[i]++;
+
+  cull.drawn[lod[i]]++;
+  return lod[i];
+}
+
+/* should transparent nodes be drawn far to near this frame?  Weighted
+ * blending falls back to this when the shaders aren't drawing. */
+static int depth_sorted(void) {
+  return transparent && !wireframe && transparency != TRANSPARENCY_CHAIN;
+}
+
+/* Put count items in order far to near, given the depth of each.  This is
+ * a radix sort on the bits of the depths, a byte at a time, so it takes
+ * four passes over the items however the depths fall and the cost per
+ * frame stays linear in the number of nodes. */
+static void depth_sort(const float *depth, int *item, int count) {
+  static unsigned int *key, *spare_key;
+  static int *spare_item, room;
+  unsigned int *from_key, *to_key;
+  int *from_item, *to_item;
+  int shift, i;
+  long long start = real_nsec();
+
+  if (count > room) {
+    unsigned int *k = realloc(key, 2 * count * sizeof(unsigned int));
+    int *t = realloc(spare_item, count * sizeof(int));
+
+    if (k) key = k;
+    if (t) spare_item = t;
+    if (!k || !t) return;
+    spare_key = key + count;
+    room = count;
+  }
+
+  for (i = 0; i < count; i++) {
+    unsigned int bits;
+
+    /* flip the bits so they sort as unsigned the way the floats do, then
+     * flip them all again to put the far ones first */
+    memcpy(&bits, &depth[i], sizeof(bits));
+    bits ^= bits & 0x80000000U ? 0xffffffffU : 0x80000000U;
+    key[i] = ~bits;
+  }
+
+  from_key = key;
+  to_key = spare_key;
+  from_item = item;
+  to_item = spare_item;
+  for (shift = 0; shift < 32; shift += 8) {
+    int start_of[257];
+    unsigned int *swap_key;
+    int *swap_item;
+
+    memset(start_of, 0, sizeof(start_of));
+    for (i = 0; i < count; i++) start_of[(from_key[i] >> shift & 0xff) + 1]++;
+    for (i = 0; i < 256; i++) start_of[i + 1] += start_of[i];
+    for (i = 0; i < count; i++) {
+      int to = start_of[from_key[i] >> shift & 0xff]++;
+
+      to_key[to] = from_key[i];
+      to_item[to] = from_item[i];
+    }
+    swap_key = from_key;
+    from_key = to_key;
+    to_key = swap_key;
+    swap_item = from_item;
+    from_item = to_item;
+    to_item = swap_item;
+  }
+  /* after an even number of passes the items are back in item[] */
+
+  transparency_cost += real_nsec() - start;
+}
+
+/* Put the nodes of one colour before those of the other, keeping their
+ * order otherwise, so drawing them changes the material only twice.  Only
+ * for opaque nodes, which can be drawn in any order. */
+static void order_by_colour(int *item, int count) {
+  int sorted[NODE_COUNT];
+  int parity, i, n = 0;
+
+  for (parity = 0; parity < 2; parity++)
+    for (i = 0; i < count; i++)
+      if (item[i] % 2 == parity) sorted[n++] = item[i];
+  memcpy(item, sorted, count * sizeof(*item));
+}
+
+/* the display list to draw a node with at a level of detail */
+static GLuint node_list(int lod) {
+  if (lod == LOD_POINT) return glc->node_point;
+  if (wireframe) return glc->node_wire;
+  return lod == LOD_PLAIN ? glc->node_plain : glc->node_solid;
+}
+
+#ifdef GL_VERSION_1_5
+/* draw a box, for an occlusion query to test instead of the snake */
+static void draw_box(float box[2][3]) {
+  static const int face[6][4] = {{0, 2, 6, 4}, {1, 5, 7, 3}, {0, 4, 5, 1},
+                                 {2, 3, 7, 6}, {0, 1, 3, 2}, {4, 6, 7, 5}};
+  int i, j;
+
+  glBegin(GL_QUADS);
+  for (i = 0; i < 6; i++)
+    for (j = 0; j < 4; j++)
+      glVertex3f(box[face[i][j] & 1][0], box[face[i][j] >> 1 & 1][1],
+                 box[face[i][j] >> 2][2]);
+  glEnd();
+}
+
+/* Pick up the answer to snake s's last occlusion query, if it is in yet.
+ * Results are a frame behind, which is near enough and never stalls. */
+static void scene_query_result(struct snake_scene *sc, int s) {
+  GLuint ready, samples;
+
+  if (!sc->pending[s]) return;
+  glGetQueryObjectuiv(sc->query[s], GL_QUERY_RESULT_AVAILABLE, &ready);
+  if (!ready) return;
+  glGetQueryObjectuiv(sc->query[s], GL_QUERY_RESULT, &samples);
+  sc->hidden[s] = samples == 0;
+  sc->pending[s] = 0;
+}
+#endif
+
+/* sort the snakes nearest first, starting from last frame's order */
+static void scene_sort(struct snake_scene *sc, const struct frustum *f) {
+  int s, i;
+
+  for (s = 0; s < sc->count; s++)
+    sc->depth[s] = frustum_depth(f, sc->place[s]);
+  /* the order barely changes between frames, so this is close to linear */
+  for (i = 1; i < sc->count; i++) {
+    int t = sc->order[i], j;
+
+    for (j = i; j > 0 && sc->depth[sc->order[j - 1]] > sc->depth[t]; j--)
+      sc->order[j] = sc->order[j - 1];
+    sc->order[j] = t;
+  }
+}
+
+/*
+ * The GLSL renderer.  The CPU works out the transform of each node once a
+ * snake, as the fixed function path does, and hands the shader the lot
+ * with the view, the place and the colours; each vertex then takes one
+ * matrix multiply.  The nodes are instances of one vertex buffer holding
+ * the solid prism, and the shaders light them the same way gl_init sets
+ * up the fixed function lights.  Every node of a snake in view is drawn
+ * at full detail, one draw call a snake, so level of detail, culling
+ * single nodes and occlusion queries are left to the fixed function path.
+ * Wireframe, interactive mode and sorted transparency still take the
+ * fixed function path too.
+ */
+
+#define GLSL_STR(x) #x
+#define GLSL_XSTR(x) GLSL_STR(x)
+
+static const char *glsl_vertex =
+    "#version 140\n"
+    "#define NODE_COUNT " GLSL_XSTR(NODE_COUNT) "\n"
+    "in vec3 position;\n"
+    "in vec3 normal;\n"
+    "uniform mat4 projection;\n"
+    "uniform mat4 view;\n"
+    "uniform mat4 node[NODE_COUNT];\n"
+    "uniform vec3 place;\n"
+    "uniform vec4 colour[2];\n"
+    "out vec4 shade;\n"
+    "\n"
+    "void main() {\n"
+    "  const vec3 light0 = vec3(0.0, 0.447214, 0.894427);\n"
+    "  const vec3 light1 = vec3(0.0, 0.998752, -0.049938);\n"
+    "  mat4 m = node[gl_InstanceID];\n"
+    "  vec4 c = colour[(gl_InstanceID + 1) % 2];\n"
+    "  vec3 n, h;\n"
+    "\n"
+    "  gl_Position = projection * view *\n"
+    "                vec4((m * vec4(position, 1.0)).xyz + place, 1.0);\n"
+    "\n"
+    "  /* ambient, diffuse from both lights, and specular from the second */\n"
+    "  n = normalize(mat3(view) * (mat3(m) * normal));\n"
+    "  h = normalize(light1 + vec3(0.0, 0.0, 1.0));\n"
+    "  shade.rgb = c.rgb * (0.2 + max(dot(n, light0), 0.0) +\n"
+    "              max(dot(n, light1), 0.0));\n"
+    "  if (dot(n, light1) > 0.0)\n"
+    "    shade.rgb += vec3(0.1 * pow(max(dot(n, h), 0.0), 20.0));\n"
+    "  shade.a = c.a;\n"
+    "}\n";
+
+static const char *glsl_fragment =
+    "#version 140\n"
+    "in vec4 shade;\n"
+    "out vec4 fragment;\n"
+    "void main() { fragment = shade; }\n";
+
+/* weighted blended transparency: add up the colours weighted by how near
+ * and how opaque each fragment is, and how much of the background shows */
+static const char *glsl_weighted =
+    "#version 140\n"
+    "in vec4 shade;\n"
+    "out vec4 accum;\n"
+    "out float reveal;\n"
+    "void main() {\n"
+    "  float w = shade.a *\n"
+    "            clamp(3e3 * pow(1.0 - gl_FragCoord.z, 3.0), 1e-2, 3e3);\n"
+    "  accum = vec4(shade.rgb * shade.a, shade.a) * w;\n"
+    "  reveal = shade.a;\n"
+    "}\n";
+
+/* then put the average colour over the background */
+static const char *glsl_composite_vertex =
+    "#version 140\n"
+    "void main() {\n"
+    "  gl_Position = vec4(gl_VertexID == 1 ? 3.0 : -1.0,\n"
+    "                     gl_VertexID == 2 ? 3.0 : -1.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *glsl_composite =
+    "#version 140\n"
+    "uniform sampler2D accum_map;\n"
+    "uniform sampler2D reveal_map;\n"
+    "out vec4 fragment;\n"
+    "void main() {\n"
+    "  ivec2 p = ivec2(gl_FragCoord.xy);\n"
+    "  vec4 a = texelFetch(accum_map, p, 0);\n"
+    "  fragment = vec4(a.rgb / max(a.a, 1e-5),\n"
+    "                  texelFetch(reveal_map, p, 0).r);\n"
+    "}\n";
+
+/* a program that draws snakes, and where its uniforms are */
+struct glsl_program {
+  GLuint id;
+  GLint projection, view, node, place, colour;
+};
+
+static struct {
+  struct glsl_program draw, weighted, *current;
+  GLuint buffer;
+  GLsizei vertices;
+  /* weighted blended transparency: the composite program, and the
+   * targets the colours and revealage are added up in */
+  GLuint composite;
+  GLuint framebuffer, accum, reveal;
+  GLint width, height;
+  GLint previous; /* framebuffer to composite into */
+  /* the capabilities and blend function to put back after it */
+  int was[GLS_CAPS], was_blend;
+  GLenum blend[2];
+} glsl;
+
+#ifdef GL_VERSION_3_1
+/* compile one shader, and complain if it won't */
+static GLuint glsl_compile(GLenum type, const char *source) {
+  GLuint shader = glCreateShader(type);
+  GLint ok;
+
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "glsnake: shader: %s\n", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+/* Compile and link a program.  Fragment outputs are bound in the order
+ * given in outputs, which is NULL terminated. */
+static GLuint glsl_link(const char *vertex, const char *fragment,
+                        const char *const *outputs) {
+  GLuint program, vs, fs;
+  GLint ok;
+  int i;
+
+  if (!(vs = glsl_compile(GL_VERTEX_SHADER, vertex))) return 0;
+  if (!(fs = glsl_compile(GL_FRAGMENT_SHADER, fragment))) {
+    glDeleteShader(vs);
+    return 0;
+  }
+  program = glCreateProgram();
+  glAttachShader(program, vs);
+  glAttachShader(program, fs);
+  glBindAttribLocation(program, 0, "position");
+  glBindAttribLocation(program, 1, "normal");
+  for (i = 0; outputs[i]; i++) glBindFragDataLocation(program, i, outputs[i]);
+  glLinkProgram(program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+/* link a snake drawing program with the given fragment shader */
+static int glsl_program(struct glsl_program *prog, const char *fragment,
+                        const char *const *outputs) {
+  if (!(prog->id = glsl_link(glsl_vertex, fragment, outputs))) return 0;
+  prog->projection = glGetUniformLocation(prog->id, "projection");
+  prog->view = glGetUniformLocation(prog->id, "view");
+  prog->node = glGetUniformLocation(prog->id, "node");
+  prog->place = glGetUniformLocation(prog->id, "place");
+  prog->colour = glGetUniformLocation(prog->id, "colour");
+  return 1;
+}
+#endif
+
+/* Build the shaders and the prism vertex buffer.  Returns 0 if the GL
+ * isn't new enough, which needs instancing from 3.1.  Weighted blended
+ * transparency also needs a blend function per target, from 4.0; without
+ * it, snakes are sorted instead. */
+static int glsl_init(void) {
+#ifdef GL_VERSION_3_1
+  static const char *const draw_out[] = {"fragment", NULL};
+  static const char *const weighted_out[] = {"accum", "reveal", NULL};
+  const char *version = (const char *)glGetString(GL_VERSION);
+  GLfloat(*vertex)[2][3];
+  int major = 0, minor = 0;
+  size_t i;
+  int j, k;
+
+  if (!version || sscanf(version, "%d.%d", &major, &minor) != 2 ||
+      major * 10 + minor < 31)
+    return 0;
+  if (!glsl_program(&glsl.draw, glsl_fragment, draw_out)) return 0;
+
+#ifdef GL_VERSION_4_0
+  if (transparency == TRANSPARENCY_WEIGHTED && major >= 4 &&
+      glsl_program(&glsl.weighted, glsl_weighted, weighted_out) &&
+      (glsl.composite = glsl_link(glsl_composite_vertex, glsl_composite,
+                                  draw_out)) != 0) {
+    glUseProgram(glsl.composite);
+    glUniform1i(glGetUniformLocation(glsl.composite, "accum_map"), 0);
+    glUniform1i(glGetUniformLocation(glsl.composite, "reveal_map"), 1);
+    glUseProgram(0);
+  }
+#endif
+  if (transparency == TRANSPARENCY_WEIGHTED && !glsl.composite) {
+    fprintf(stderr, "glsnake: no weighted blended transparency, "
+                    "sorting instead\n");
+    transparency = TRANSPARENCY_SORTED;
+  }
+
+  /* the solid prism as triangles, each vertex a position and a normal */
+  glsl.vertices = 0;
+  for (i = 0; i < SOLID_PRISM_FACES; i++)
+    glsl.vertices += 3 * (solid_prism_f[i][0] - 2);
+  if ((vertex = malloc(glsl.vertices * sizeof(*vertex))) == NULL) return 0;
+  glsl.vertices = 0;
+  for (i = 0; i < SOLID_PRISM_FACES; i++) {
+    const unsigned char *face = solid_prism_f[i];
+
+    for (j = 1; j < face[0] - 1; j++) {
+      const int corner[3] = {face[2], face[2 + j], face[3 + j]};
+
+      for (k = 0; k < 3; k++) {
+        memcpy(vertex[glsl.vertices][0], solid_prism_v[corner[k]],
+               sizeof(vertex[0][0]));
+        memcpy(vertex[glsl.vertices++][1], solid_prism_n[face[1]],
+               sizeof(vertex[0][1]));
+      }
+    }
+  }
+  glGenBuffers(1, &glsl.buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, glsl.buffer);
+  glBufferData(GL_ARRAY_BUFFER, glsl.vertices * sizeof(*vertex), vertex,
+               GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  free(vertex);
+
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* should this frame use weighted blended transparency? */
+static int glsl_weighted_active(void) {
+  return glsl.composite && transparent &&
+         transparency == TRANSPARENCY_WEIGHTED;
+}
+
+/* Should this frame go through the shaders?  They draw the nodes in chain
+ * order, so see-through snakes that want sorting take the fixed function
+ * path, which sorts them. */
+static int glsl_active(void) {
+  return shaders && !wireframe && !shown->interactive &&
+         (!depth_sorted() || glsl_weighted_active());
+}
+
+#ifdef GL_VERSION_4_0
+/* make sure the transparency targets match the viewport */
+static void glsl_targets(GLint width, GLint height) {
+  if (glsl.framebuffer && width == glsl.width && height == glsl.height)
+    return;
+
+  if (!glsl.framebuffer) {
+    glGenFramebuffers(1, &glsl.framebuffer);
+    glGenTextures(1, &glsl.accum);
+    glGenTextures(1, &glsl.reveal);
+  }
+  glsl.width = width;
+  glsl.height = height;
+
+  glBindTexture(GL_TEXTURE_2D, glsl.accum);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA,
+               GL_FLOAT, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, glsl.reveal);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, width, height, 0, GL_RED, GL_FLOAT,
+               NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, glsl.framebuffer);
+  glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                         GL_TEXTURE_2D, glsl.accum, 0);
+  glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                         GL_TEXTURE_2D, glsl.reveal, 0);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, glsl.previous);
+}
+
+/* start adding up the snakes' colours in the transparency targets */
+static void glsl_weighted_begin(void) {
+  static const GLenum targets[2] = {GL_COLOR_ATTACHMENT0,
+                                    GL_COLOR_ATTACHMENT1};
+  static const GLfloat clear_accum[4] = {0.0, 0.0, 0.0, 0.0};
+  static const GLfloat clear_reveal[4] = {1.0, 1.0, 1.0, 1.0};
+  GLint viewport[4];
+
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &glsl.previous);
+  glsl_targets(viewport[2], viewport[3]);
+
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, glsl.framebuffer);
+  glDrawBuffers(2, targets);
+  glClearBufferfv(GL_COLOR, 0, clear_accum);
+  glClearBufferfv(GL_COLOR, 1, clear_reveal);
+
+  memcpy(glsl.was, gls.cap, sizeof(glsl.was));
+  glsl.was_blend = gls.blend_known;
+  memcpy(glsl.blend, gls.blend, sizeof(glsl.blend));
+  gls_enable(GLS_DEPTH_TEST, 0);
+  /* each target blends its own way, which gls can't keep track of */
+  glBlendFunci(0, GL_ONE, GL_ONE);
+  glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+  gls.blend_known = 0;
+}
+
+/* put what was added up over the background, and put things back */
+static void glsl_weighted_end(void) {
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, glsl.previous);
+  glUseProgram(glsl.composite);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, glsl.accum);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, glsl.reveal);
+  gls_blend_func(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  if (glsl.was_blend) gls_blend_func(glsl.blend[0], glsl.blend[1]);
+  gls_enable(GLS_DEPTH_TEST, glsl.was[GLS_DEPTH_TEST]);
+}
+#endif
+
+#ifdef GL_VERSION_3_1
+/* Set up everything the shaders need that is the same for every snake.
+ * The view is left on the modelview stack, as the fixed function path
+ * leaves it, until glsl_end. */
+static void glsl_begin(float scale) {
+  struct glsl_program *prog = &glsl.draw;
+  float projection[16], view[16];
+
+#ifdef GL_VERSION_4_0
+  if (glsl_weighted_active()) {
+    long long start = real_nsec();
+
+    glsl_weighted_begin();
+    prog = &glsl.weighted;
+    transparency_cost += real_nsec() - start;
+  }
+#endif
+  glsl.current = prog;
+
+  glPushMatrix();
+#ifdef HAVE_GLUT
+  /* apply the mouse drag rotation */
+  ui_mousedrag();
+#endif
+  /* apply the continuous rotation */
+  glRotatef(shown->yspin, 0.0, 1.0, 0.0);
+  glRotatef(shown->zspin, 0.0, 0.0, 1.0);
+  glScalef(scale, scale, scale);
+
+  /* the projection glsnake_reshape set up, and the view */
+  glUseProgram(prog->id);
+  glGetFloatv(GL_PROJECTION_MATRIX, projection);
+  glGetFloatv(GL_MODELVIEW_MATRIX, view);
+  glUniformMatrix4fv(prog->projection, 1, GL_FALSE, projection);
+  glUniformMatrix4fv(prog->view, 1, GL_FALSE, view);
+
+  glBindBuffer(GL_ARRAY_BUFFER, glsl.buffer);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), NULL);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat),
+                        (const GLvoid *)(3 * sizeof(GLfloat)));
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+}
+
+/* draw one snake, its nodes instances of the prism placed by node_mat,
+ * with its centre of mass com at place */
+static void glsl_snake(float node_mat[][16], const float *com,
+                       float node_colour[2][4], const float *place) {
+  float offset[3];
+  int k;
+
+  for (k = 0; k < 3; k++) offset[k] = place[k] - com[k];
+  glUniformMatrix4fv(glsl.current->node, NODE_COUNT, GL_FALSE, node_mat[0]);
+  glUniform4fv(glsl.current->colour, 2, node_colour[0]);
+  glUniform3fv(glsl.current->place, 1, offset);
+  glDrawArraysInstanced(GL_TRIANGLES, 0, glsl.vertices, NODE_COUNT);
+  gls.draws++;
+  cull.drawn[LOD_FULL] += NODE_COUNT;
+}
+
+static void glsl_end(void) {
+  glPopMatrix();
+  glDisableVertexAttribArray(0);
+  glDisableVertexAttribArray(1);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+#ifdef GL_VERSION_4_0
+  if (glsl.current == &glsl.weighted) {
+    long long start = real_nsec();
+
+    glsl_weighted_end();
+    transparency_cost += real_nsec() - start;
+  }
+#endif
+  glUseProgram(0);
+}
+#endif
+
+/*
+ * Baking.  While a single snake isn't morphing its shape stays the same, so
+ * all its prisms are transformed once into one vertex buffer, each vertex
+ * with its colour and with the centre of mass taken off.  Every frame
+ * until the next morph is then one draw call under the spin.  The buffer
+ * is baked again whenever the pose, explode distance, wireframe or
+ * colours differ from what it was baked with.
+ */
+
+/* the edges of the wire prism, in pairs of corners */
+static const unsigned char wire_prism_e[][2] = {
+    {0, 1}, {1, 2}, {2, 0}, {0, 3}, {3, 4}, {4, 5}, {5, 3}, {1, 4}, {2, 5}};
+
+#define WIRE_PRISM_EDGES (sizeof(wire_prism_e) / sizeof(wire_prism_e[0]))
+
+/* a baked vertex: position, normal, colour */
+#define BAKE_STRIDE 10
+
+static struct {
+  int valid;
+  /* what the buffer was baked for */
+  int node[NODE_COUNT];
+  float gap;
+  int wire;
+  float colour[2][4];
+  /* the buffer, and how many vertices are in it */
+  GLuint buffer;
+  GLsizei vertices;
+  /* the middle of each node, for sorting */
+  float centre[NODE_COUNT][3];
+} bake;
+
+#ifdef GL_VERSION_1_5
+/* append a corner and normal of node transform m, less com, to v */
+static GLfloat *bake_vertex(GLfloat *v, const float *m, const float *com,
+                            const float *corner, const float *normal,
+                            const float *rgba) {
+  int k;
+
+  for (k = 0; k < 3; k++) {
+    v[k] = m[k] * corner[0] + m[4 + k] * corner[1] + m[8 + k] * corner[2] +
+           m[12 + k] - com[k];
+    v[3 + k] =
+        m[k] * normal[0] + m[4 + k] * normal[1] + m[8 + k] * normal[2];
+  }
+  memcpy(v + 6, rgba, 4 * sizeof(GLfloat));
+  return v + BAKE_STRIDE;
+}
+
+/* transform every prism of the current pose into the bake buffer */
+static int bake_pose(void) {
+  float node_mat[NODE_COUNT][16], com[3];
+  static const float no_normal[3] = {0.0, 0.0, 0.0};
+  GLfloat *vertex, *v;
+  size_t f;
+  int i, j, k;
+
+  bake.vertices = 0;
+  if (wireframe)
+    bake.vertices = 2 * WIRE_PRISM_EDGES;
+  else
+    for (f = 0; f < SOLID_PRISM_FACES; f++)
+      bake.vertices += 3 * (solid_prism_f[f][0] - 2);
+  bake.vertices *= NODE_COUNT;
+  if ((v = vertex = malloc(bake.vertices * BAKE_STRIDE * sizeof(GLfloat))) ==
+      NULL)
+    return bake.valid = 0;
+
+  snake_kinematics(shown->shape.node, shown->explode, node_mat, com);
+  for (i = 0; i < NODE_COUNT; i++) {
+    const float *rgba = shown->colour[(i + 1) % 2];
+
+    for (k = 0; k < 3; k++)
+      bake.centre[i][k] = 0.5 * (node_mat[i][k] + node_mat[i][4 + k] +
+                                 node_mat[i][8 + k]) +
+                          node_mat[i][12 + k] - com[k];
+
+    if (wireframe) {
+      for (f = 0; f < WIRE_PRISM_EDGES; f++)
+        for (k = 0; k < 2; k++)
+          v = bake_vertex(v, node_mat[i], com, wire_prism_v[wire_prism_e[f][k]],
+                          no_normal, rgba);
+      continue;
+    }
+    /* each quad goes in as two triangles */
+    for (f = 0; f < SOLID_PRISM_FACES; f++) {
+      const unsigned char *face = solid_prism_f[f];
+
+      for (j = 1; j < face[0] - 1; j++) {
+        v = bake_vertex(v, node_mat[i], com, solid_prism_v[face[2]],
+                        solid_prism_n[face[1]], rgba);
+        v = bake_vertex(v, node_mat[i], com, solid_prism_v[face[2 + j]],
+                        solid_prism_n[face[1]], rgba);
+        v = bake_vertex(v, node_mat[i], com, solid_prism_v[face[3 + j]],
+                        solid_prism_n[face[1]], rgba);
+      }
+    }
+  }
+
+  if (!bake.buffer) glGenBuffers(1, &bake.buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, bake.buffer);
+  glBufferData(GL_ARRAY_BUFFER, bake.vertices * BAKE_STRIDE * sizeof(GLfloat),
+               vertex, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  free(vertex);
+
+  memcpy(bake.node, shown->shape.node, sizeof(bake.node));
+  bake.gap = shown->explode;
+  bake.wire = wireframe;
+  memcpy(bake.colour, shown->colour, sizeof(bake.colour));
+  return bake.valid = 1;
+}
+
+/* Can this frame be drawn from the bake buffer?  Bakes the pose first if
+ * the buffer is out of date.  Interactive mode highlights the selected
+ * nodes, so it is never baked. */
+static int bake_ready(void) {
+  if (shown->morphing || shown->interactive) return 0;
+  if (bake.valid && bake.gap == shown->explode && bake.wire == wireframe &&
+      !memcmp(bake.node, shown->shape.node, sizeof(bake.node)) &&
+      !memcmp(bake.colour, shown->colour, sizeof(bake.colour)))
+    return 1;
+  return bake_pose();
+}
+
+/* Draw the bake buffer in one go.  For sorted transparency the nodes go
+ * far to near, still in one call. */
+static void bake_draw(void) {
+  const GLsizei stride = BAKE_STRIDE * sizeof(GLfloat);
+  GLint first[NODE_COUNT];
+  GLsizei count[NODE_COUNT];
+  int order[NODE_COUNT];
+  float depth[NODE_COUNT];
+  struct frustum f;
+  int i;
+
+  glBindBuffer(GL_ARRAY_BUFFER, bake.buffer);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glVertexPointer(3, GL_FLOAT, stride, NULL);
+  glColorPointer(4, GL_FLOAT, stride, (const GLvoid *)(6 * sizeof(GLfloat)));
+  gls.draws++;
+  if (wireframe) {
+    glDrawArrays(GL_LINES, 0, bake.vertices);
+  } else {
+    /* the vertex colours stand in for glMaterialfv */
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glNormalPointer(GL_FLOAT, stride, (const GLvoid *)(3 * sizeof(GLfloat)));
+    glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE);
+    gls_enable(GLS_COLOR_MATERIAL, 1);
+    if (depth_sorted()) {
+      frustum_get(&f);
+      for (i = 0; i < NODE_COUNT; i++) {
+        depth[i] = frustum_depth(&f, bake.centre[i]);
+        order[i] = i;
+      }
+      depth_sort(depth, order, NODE_COUNT);
+      for (i = 0; i < NODE_COUNT; i++) {
+        count[i] = bake.vertices / NODE_COUNT;
+        first[i] = order[i] * count[i];
+      }
+      gls_depth_mask(0);
+      glMultiDrawArrays(GL_TRIANGLES, first, count, NODE_COUNT);
+      gls_depth_mask(1);
+    } else {
+      glDrawArrays(GL_TRIANGLES, 0, bake.vertices);
+    }
+    gls_enable(GLS_COLOR_MATERIAL, 0);
+    /* the vertex colours are left in the material */
+    gls.material_known[0] = gls.material_known[1] = 0;
+    glDisableClientState(GL_NORMAL_ARRAY);
+  }
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  cull.drawn[LOD_FULL] += NODE_COUNT;
+}
+#endif
+
+/* work out snake s's node transforms and extent again if it has moved, or
+ * the explode distance has changed */
+static void scene_pose(struct snake_scene *sc, int s) {
+  if (sc->posed[s] == shown->moved[s] && sc->gap == shown->explode) return;
+  snake_kinematics(shown->angle + s * NODE_COUNT, shown->explode,
+                   sc->node_mat[s], sc->com[s]);
+  snake_extent(sc->node_mat[s], sc->com[s], sc->centre[s], sc->extent[s],
+               &sc->radius[s]);
+  sc->posed[s] = shown->moved[s];
+}
+
+/*
+ * Software rendering, for displays without a GPU, where the generic GL
+ * rasteriser is slow at this many small prisms.  Each node in view is
+ * posed, lit and projected on the CPU and its triangles are binned into
+ * SOFT_TILE pixel square tiles.  A pool of threads then fills the tiles,
+ * each tile with its own part of the depth buffer, testing four pixels at
+ * a time against the edges.  The finished frame goes to the window with
+ * one glDrawPixels.  Like the shaders, this leaves wireframe and
+ * interactive mode to the fixed function path.
+ */
+
+#define SOFT_TILE 64    /* pixels along a side, a multiple of four */
+#define SOFT_THREADS 16 /* the most threads to fill tiles with */
+
+#define SOLID_PRISM_CORNERS (sizeof(solid_prism_v) / sizeof(solid_prism_v[0]))
+
+/* the faces of the plain prism, as solid_prism_f has them, on the corners
+ * of wire_prism_v */
+static const unsigned char plain_prism_f[][6] = {{3, 15, 0, 1, 2},
+                                                 {3, 19, 3, 5, 4},
+                                                 {4, 16, 0, 3, 4, 1},
+                                                 {4, 17, 1, 4, 5, 2},
+                                                 {4, 18, 0, 2, 5, 3}};
+
+#define PLAIN_PRISM_FACES (sizeof(plain_prism_f) / sizeof(plain_prism_f[0]))
+
+/* A triangle set up for filling.  A pixel centre is inside where all three
+ * edge functions a x + b y + c are positive, or zero on an edge the
+ * triangle owns, so neighbours sharing an edge don't both draw it. */
+struct soft_triangle {
+  float edge[3][3];
+  unsigned char owns[3];
+  float z[3]; /* the depth, z[0] x + z[1] y + z[2] */
+  int box[4]; /* left, bottom, right and top pixels */
+  unsigned char rgba[4];
+  int alpha; /* out of 256, if blending */
+  int blend, depth_write;
+};
+
+/* the triangles touching a tile, in drawing order */
+struct soft_bin {
+  int *triangle;
+  int count, room;
+};
+
+static struct {
+  int width, height;
+  /* the size of the buffers, rounded up to whole tiles */
+  int pitch, rows, tiles_x, tiles_y;
+  unsigned char *colour; /* rgba, bottom row first as glDrawPixels has it */
+  float *depth;
+  unsigned char clear[4];
+  struct soft_triangle *triangle;
+  int triangles, room;
+  struct soft_bin *bin;
+  /* triangles drawn, for benchmark mode */
+  long drawn;
+#ifdef HAVE_PTHREAD
+  /* the pool, and the tiles still to fill this frame */
+  pthread_t thread[SOFT_THREADS];
+  int threads, stop;
+  pthread_mutex_t lock;
+  pthread_cond_t go, done;
+  int frame, next_tile, busy;
+#endif
+} soft;
+
+/* should this frame be drawn in software? */
+static int soft_active(void) {
+  return software && !wireframe && !shown->interactive;
+}
+
+/* out = a b, for column major 4x4 matrices */
+static void soft_multiply(float *out, const float *a, const float *b) {
+  int r, c, k;
+
+  for (c = 0; c < 4; c++)
+    for (r = 0; r < 4; r++) {
+      out[c * 4 + r] = 0.0;
+      for (k = 0; k < 4; k++) out[c * 4 + r] += a[k * 4 + r] * b[c * 4 + k];
+    }
+}
+
+/* size the buffers to the viewport; returns 0 if out of memory */
+static int soft_resize(int width, int height) {
+  int pitch = (width + SOFT_TILE - 1) / SOFT_TILE * SOFT_TILE;
+  int rows = (height + SOFT_TILE - 1) / SOFT_TILE * SOFT_TILE;
+  int t;
+
+  soft.width = width;
+  soft.height = height;
+  if (pitch == soft.pitch && rows == soft.rows) return soft.colour != NULL;
+
+  for (t = 0; t < soft.tiles_x * soft.tiles_y; t++)
+    free(soft.bin[t].triangle);
+  free(soft.bin);
+  free(soft.colour);
+  free(soft.depth);
+  soft.pitch = pitch;
+  soft.rows = rows;
+  soft.tiles_x = pitch / SOFT_TILE;
+  soft.tiles_y = rows / SOFT_TILE;
+  soft.bin = calloc(soft.tiles_x * soft.tiles_y, sizeof(struct soft_bin));
+  soft.colour = malloc(4 * pitch * rows);
+  soft.depth = malloc(pitch * rows * sizeof(float));
+  if (!soft.bin || !soft.colour || !soft.depth) {
+    free(soft.bin);
+    free(soft.colour);
+    free(soft.depth);
+    soft.bin = NULL;
+    soft.colour = NULL;
+    soft.depth = NULL;
+    soft.pitch = soft.rows = soft.tiles_x = soft.tiles_y = 0;
+    return 0;
+  }
+  return 1;
+}
+
+/* Set up a triangle from its corners in window coordinates, x and y in
+ * pixels and z the depth, and add it to the bins of the tiles it covers.
+ * Both windings are drawn, as GL draws them with culling off. */
+static void soft_triangle(const float *p0, const float *p1, const float *p2,
+                          const unsigned char *rgba, int alpha, int blend) {
+  const float *p[3];
+  struct soft_triangle *t;
+  float area, dzdx, dzdy;
+  int box[4], k, x, y;
+
+  area = (p1[0] - p0[0]) * (p2[1] - p0[1]) - (p2[0] - p0[0]) * (p1[1] - p0[1]);
+  if (!(area != 0.0)) return;
+  p[0] = p0;
+  /* make it anticlockwise, so the inside is where the edges are positive */
+  p[1] = area > 0.0 ? p1 : p2;
+  p[2] = area > 0.0 ? p2 : p1;
+  area = fabs(area);
+
+  /* the pixels whose centres might be inside */
+  box[0] = ceil(MIN(p0[0], MIN(p1[0], p2[0])) - 0.5);
+  box[1] = ceil(MIN(p0[1], MIN(p1[1], p2[1])) - 0.5);
+  box[2] = floor(MAX(p0[0], MAX(p1[0], p2[0])) - 0.5);
+  box[3] = floor(MAX(p0[1], MAX(p1[1], p2[1])) - 0.5);
+  box[0] = MAX(box[0], 0);
+  box[1] = MAX(box[1], 0);
+  box[2] = MIN(box[2], soft.width - 1);
+  box[3] = MIN(box[3], soft.height - 1);
+  if (box[0] > box[2] || box[1] > box[3]) return;
+
+  if (soft.triangles == soft.room) {
+    int room = soft.room ? 2 * soft.room : 4096;
+    struct soft_triangle *grown =
+        realloc(soft.triangle, room * sizeof(struct soft_triangle));
+
+    if (!grown) return;
+    soft.triangle = grown;
+    soft.room = room;
+  }
+  t = &soft.triangle[soft.triangles];
+
+  /* the edge functions, taken at pixel centres.  Going along an edge the
+   * other way gives exactly the same values negated, so of two triangles
+   * sharing an edge just the one with a > 0, or a == 0 and b > 0, owns
+   * pixels lying on it. */
+  for (k = 0; k < 3; k++) {
+    const float *from = p[k], *to = p[(k + 1) % 3];
+    float a = from[1] - to[1], b = to[0] - from[0];
+
+    t->edge[k][0] = a;
+    t->edge[k][1] = b;
+    t->edge[k][2] = from[0] * to[1] - to[0] * from[1] + 0.5 * a + 0.5 * b;
+    t->owns[k] = a > 0.0 || (a == 0.0 && b > 0.0);
+  }
+
+  dzdx = ((p[1][2] - p[0][2]) * (p[2][1] - p[0][1]) -
+          (p[2][2] - p[0][2]) * (p[1][1] - p[0][1])) /
+         area;
+  dzdy = ((p[2][2] - p[0][2]) * (p[1][0] - p[0][0]) -
+          (p[1][2] - p[0][2]) * (p[2][0] - p[0][0])) /
+         area;
+  t->z[0] = dzdx;
+  t->z[1] = dzdy;
+  t->z[2] = p[0][2] - dzdx * (p[0][0] - 0.5) - dzdy * (p[0][1] - 0.5);
+
+  memcpy(t->box, box, sizeof(box));
+  memcpy(t->rgba, rgba, 4);
+  t->alpha = alpha;
+  t->blend = blend;
+  /* sorted transparency draws far to near without writing depth, as the
+   * GL path does */
+  t->depth_write = !blend || !depth_sorted();
+
+  for (y = box[1] / SOFT_TILE; y <= box[3] / SOFT_TILE; y++)
+    for (x = box[0] / SOFT_TILE; x <= box[2] / SOFT_TILE; x++) {
+      struct soft_bin *bin = &soft.bin[y * soft.tiles_x + x];
+
+      if (bin->count == bin->room) {
+        int room = bin->room ? 2 * bin->room : 256;
+        int *grown = realloc(bin->triangle, room * sizeof(int));
+
+        if (!grown) continue;
+        bin->triangle = grown;
+        bin->room = room;
+      }
+      bin->triangle[bin->count++] = soft.triangles;
+    }
+  soft.triangles++;
+}
+
+/* Light, project and bin the faces of one node.  m takes the prism to the
+ * eye, as the modelview would, and proj on to the clip space. */
+static void soft_node(const float *m, const float *proj, int plain,
+                      const float *rgba) {
+  /* the lights as the shaders have them, from gl_init */
+  static const float light0[3] = {0.0, 0.447214, 0.894427};
+  static const float light1[3] = {0.0, 0.998752, -0.049938};
+  static const float half1[3] = {0.0, 0.747409, 0.664364};
+  float win[SOLID_PRISM_CORNERS][3], clip[16];
+  float(*corner)[3] = plain ? wire_prism_v : solid_prism_v;
+  const unsigned char(*faces)[6] = plain ? plain_prism_f : solid_prism_f;
+  size_t corners = plain ? 6 : SOLID_PRISM_CORNERS;
+  size_t count = plain ? PLAIN_PRISM_FACES : SOLID_PRISM_FACES;
+  int blend = transparent, alpha = 256 * rgba[3] + 0.5;
+  size_t i;
+  int j, k;
+
+  soft_multiply(clip, proj, m);
+  for (i = 0; i < corners; i++) {
+    const float *v = corner[i];
+    float p[4];
+
+    for (k = 0; k < 4; k++)
+      p[k] = clip[k] * v[0] + clip[4 + k] * v[1] + clip[8 + k] * v[2] +
+             clip[12 + k];
+    /* the eye is well back from the snakes, so rather than clip, a node
+     * reaching past the near or far plane is left out */
+    if (p[3] <= 0.0 || p[2] < -p[3] || p[2] > p[3]) return;
+    win[i][0] = (p[0] / p[3] + 1.0) * 0.5 * soft.width;
+    win[i][1] = (p[1] / p[3] + 1.0) * 0.5 * soft.height;
+    win[i][2] = p[2] / p[3];
+  }
+
+  for (i = 0; i < count; i++) {
+    const unsigned char *face = faces[i];
+    const float *normal = solid_prism_n[face[1]];
+    float n[3], len, d0, d1, shade, spec = 0.0;
+    unsigned char lit[4];
+
+    /* ambient, diffuse from both lights, and specular from the second */
+    for (k = 0; k < 3; k++)
+      n[k] = m[k] * normal[0] + m[4 + k] * normal[1] + m[8 + k] * normal[2];
+    len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    d0 = (n[0] * light0[0] + n[1] * light0[1] + n[2] * light0[2]) / len;
+    d1 = (n[0] * light1[0] + n[1] * light1[1] + n[2] * light1[2]) / len;
+    shade = 0.2 + MAX(d0, 0.0) + MAX(d1, 0.0);
+    if (d1 > 0.0) {
+      float h = (n[0] * half1[0] + n[1] * half1[1] + n[2] * half1[2]) / len;
+
+      spec = h > 0.0 ? 0.1 * pow(h, 20.0) : 0.0;
+    }
+    for (k = 0; k < 3; k++)
+      lit[k] = 255.0 * MIN(rgba[k] * shade + spec, 1.0) + 0.5;
+    lit[3] = 255.0 * rgba[3] + 0.5;
+
+    for (j = 1; j < face[0] - 1; j++)
+      soft_triangle(win[face[2]], win[face[2 + j]], win[face[3 + j]], lit,
+                    alpha, blend);
+    soft.drawn += face[0] - 2;
+  }
+}
+
+/* fill the pixels from left to right of row y that are inside triangle t
+ * and nearer than what is there */
+static void soft_span(const struct soft_triangle *t, int y, int left,
+                      int right) {
+  unsigned char *row_colour = soft.colour + 4 * y * soft.pitch;
+  float *depth = soft.depth + y * soft.pitch;
+  float row[3], z_row = t->z[1] * y + t->z[2];
+  int x, k;
+
+  for (k = 0; k < 3; k++) row[k] = t->edge[k][1] * y + t->edge[k][2];
+
+#ifdef __SSE2__
+  {
+    const __m128 lane = _mm_set_ps(3.0, 2.0, 1.0, 0.0);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i none = _mm_setzero_si128();
+    __m128 a[3], r[3], owns[3], dz = _mm_set1_ps(t->z[0]);
+    __m128 z0 = _mm_set1_ps(z_row);
+    __m128i source, premultiplied, keep;
+    unsigned int packed;
+
+    for (k = 0; k < 3; k++) {
+      a[k] = _mm_set1_ps(t->edge[k][0]);
+      r[k] = _mm_set1_ps(row[k]);
+      owns[k] = _mm_castsi128_ps(_mm_set1_epi32(t->owns[k] ? -1 : 0));
+    }
+    memcpy(&packed, t->rgba, sizeof(packed));
+    source = _mm_set1_epi32((int)packed);
+    /* blending is s a + d (256 - a), over 256, in 16 bit lanes */
+    premultiplied = _mm_mullo_epi16(_mm_unpacklo_epi8(source, none),
+                                    _mm_set1_epi16((short)t->alpha));
+    keep = _mm_set1_epi16((short)(256 - t->alpha));
+
+    for (x = left; x <= right; x += 4) {
+      __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane);
+      __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1)), z, d;
+      __m128i mask, old, pixel;
+
+      for (k = 0; k < 3; k++) {
+        __m128 e = _mm_add_ps(_mm_mul_ps(a[k], px), r[k]);
+
+        in = _mm_and_ps(in, _mm_or_ps(_mm_cmpgt_ps(e, zero),
+                                      _mm_and_ps(_mm_cmpeq_ps(e, zero),
+                                                 owns[k])));
+      }
+      if (!_mm_movemask_ps(in)) continue;
+
+      z = _mm_add_ps(_mm_mul_ps(dz, px), z0);
+      d = _mm_loadu_ps(depth + x);
+      in = _mm_and_ps(in, _mm_cmplt_ps(z, d));
+      if (!_mm_movemask_ps(in)) continue;
+      if (t->depth_write)
+        _mm_storeu_ps(depth + x,
+                      _mm_or_ps(_mm_and_ps(in, z), _mm_andnot_ps(in, d)));
+
+      mask = _mm_castps_si128(in);
+      old = _mm_loadu_si128((const __m128i *)(row_colour + 4 * x));
+      pixel = source;
+      if (t->blend) {
+        __m128i lo = _mm_unpacklo_epi8(old, none);
+        __m128i hi = _mm_unpackhi_epi8(old, none);
+
+        lo = _mm_srli_epi16(
+            _mm_add_epi16(premultiplied, _mm_mullo_epi16(lo, keep)), 8);
+        hi = _mm_srli_epi16(
+            _mm_add_epi16(premultiplied, _mm_mullo_epi16(hi, keep)), 8);
+        pixel = _mm_packus_epi16(lo, hi);
+      }
+      _mm_storeu_si128((__m128i *)(row_colour + 4 * x),
+                       _mm_or_si128(_mm_and_si128(mask, pixel),
+                                    _mm_andnot_si128(mask, old)));
+    }
+  }
+#else
+  for (x = left; x <= right; x++) {
+    unsigned char *c = row_colour + 4 * x;
+    float z;
+
+    for (k = 0; k < 3; k++) {
+      float e = t->edge[k][0] * x + row[k];
+
+      if (e < 0.0 || (e == 0.0 && !t->owns[k])) break;
+    }
+    if (k < 3) continue;
+
+    z = t->z[0] * x + z_row;
+    if (!(z < depth[x])) continue;
+    if (t->depth_write) depth[x] = z;
+
+    for (k = 0; k < 4; k++)
+      c[k] = t->blend ? (t->rgba[k] * t->alpha + c[k] * (256 - t->alpha)) >> 8
+                      : t->rgba[k];
+  }
+#endif
+}
+
+/* clear a tile, then draw its triangles into it */
+static void soft_fill(int tile) {
+  const struct soft_bin *bin = &soft.bin[tile];
+  int x0 = tile % soft.tiles_x * SOFT_TILE, y0 = tile / soft.tiles_x * SOFT_TILE;
+  int x, y, n;
+
+  for (y = y0; y < y0 + SOFT_TILE; y++) {
+    unsigned char *c = soft.colour + 4 * (y * soft.pitch + x0);
+    float *d = soft.depth + y * soft.pitch + x0;
+
+    for (x = 0; x < SOFT_TILE; x++) {
+      memcpy(c + 4 * x, soft.clear, 4);
+      d[x] = 1.0;
+    }
+  }
+
+  for (n = 0; n < bin->count; n++) {
+    const struct soft_triangle *t = &soft.triangle[bin->triangle[n]];
+    /* spans start on a multiple of four within the tile */
+    int left = MAX(t->box[0], x0) & ~3;
+    int right = MIN(t->box[2], x0 + SOFT_TILE - 1);
+    int top = MIN(t->box[3], y0 + SOFT_TILE - 1);
+
+    for (y = MAX(t->box[1], y0); y <= top; y++) soft_span(t, y, left, right);
+  }
+}
+
+#ifdef HAVE_PTHREAD
+/* fill tiles until there are none left this frame */
+static void soft_tiles(void) {
+  int tile;
+
+  for (;;) {
+    pthread_mutex_lock(&soft.lock);
+    tile = soft.next_tile++;
+    pthread_mutex_unlock(&soft.lock);
+    if (tile >= soft.tiles_x * soft.tiles_y) return;
+    soft_fill(tile);
+  }
+}
+
+/* a thread of the pool: wait for a frame, help fill it, and say so */
+static void *soft_worker(void *unused ATTRIBUTE_UNUSED) {
+  int frame = 0;
+
+  pthread_mutex_lock(&soft.lock);
+  for (;;) {
+    while (soft.frame == frame && !soft.stop)
+      pthread_cond_wait(&soft.go, &soft.lock);
+    if (soft.stop) break;
+    frame = soft.frame;
+    pthread_mutex_unlock(&soft.lock);
+    soft_tiles();
+    pthread_mutex_lock(&soft.lock);
+    if (--soft.busy == 0) pthread_cond_signal(&soft.done);
+  }
+  pthread_mutex_unlock(&soft.lock);
+  return NULL;
+}
+
+/* start a thread for each processor besides this one */
+static void soft_start(void) {
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+  pthread_mutex_init(&soft.lock, NULL);
+  pthread_cond_init(&soft.go, NULL);
+  pthread_cond_init(&soft.done, NULL);
+  while (soft.threads < MIN(processors - 1, SOFT_THREADS) &&
+         !pthread_create(&soft.thread[soft.threads], NULL, soft_worker, NULL))
+    soft.threads++;
+}
+
+/* tell the pool to finish, and wait for it */
+static void soft_stop(void) {
+  if (!soft.threads) return;
+  pthread_mutex_lock(&soft.lock);
+  soft.stop = 1;
+  pthread_cond_broadcast(&soft.go);
+  pthread_mutex_unlock(&soft.lock);
+  while (soft.threads) pthread_join(soft.thread[--soft.threads], NULL);
+}
+#endif
+
+/* fill every tile, sharing them out among the pool */
+static void soft_render(void) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&soft.lock);
+  soft.next_tile = 0;
+  soft.busy = soft.threads;
+  soft.frame++;
+  pthread_cond_broadcast(&soft.go);
+  pthread_mutex_unlock(&soft.lock);
+  soft_tiles();
+  pthread_mutex_lock(&soft.lock);
+  while (soft.busy) pthread_cond_wait(&soft.done, &soft.lock);
+  pthread_mutex_unlock(&soft.lock);
+#else
+  int tile;
+
+  for (tile = 0; tile < soft.tiles_x * soft.tiles_y; tile++) soft_fill(tile);
+#endif
+}
+
+/* put the frame in the window, over the whole viewport, putting back only
+ * the state we change, as draw_title does */
+static void soft_blit(void) {
+  int was[GLS_CAPS];
+
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  memcpy(was, gls.cap, sizeof(was));
+  gls_enable(GLS_DEPTH_TEST, 0);
+  gls_enable(GLS_BLEND, 0);
+  gls_enable(GLS_LIGHTING, 0);
+  glRasterPos2f(-1.0, -1.0);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, soft.pitch);
+  glDrawPixels(soft.width, soft.height, GL_RGBA, GL_UNSIGNED_BYTE,
+               soft.colour);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  gls_enable(GLS_DEPTH_TEST, was[GLS_DEPTH_TEST]);
+  gls_enable(GLS_BLEND, was[GLS_BLEND]);
+  gls_enable(GLS_LIGHTING, was[GLS_LIGHTING]);
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+  glPopMatrix();
+}
+
+/* Draw the snake, or every snake in the scene, in software.  The nodes in
+ * view are chosen and sorted just as the GL path does it, then drawn at
+ * full detail, or as plain prisms when they are small. */
+static void soft_display(void) {
+  struct snake_scene *sc = scene;
+  float node_mat[NODE_COUNT][16], com[3], centre[NODE_COUNT][3], box[2][3];
+  float one_depth[NODE_COUNT], radius;
+  int one_order[NODE_COUNT];
+  static const float origin[3] = {0.0, 0.0, 0.0};
+  int count = sc ? sc->count : 1;
+  int *order = sc ? sc->node_order : one_order;
+  float *depth = sc ? sc->node_depth : one_depth;
+  float view[16], proj[16], clear[4];
+  struct frustum f;
+  GLint viewport[4];
+  int s, i, k, n, visible = 0;
+
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  if (!soft_resize(viewport[2], viewport[3])) return;
+#ifdef HAVE_PTHREAD
+  if (!soft.frame && !soft.threads) soft_start();
+#endif
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+  for (k = 0; k < 4; k++) soft.clear[k] = 255.0 * clear[k] + 0.5;
+
+  /* the same transforms as the GL path, read back */
+  glPushMatrix();
+#ifdef HAVE_GLUT
+  ui_mousedrag();
+#endif
+  glRotatef(shown->yspin, 0.0, 1.0, 0.0);
+  glRotatef(shown->zspin, 0.0, 0.0, 1.0);
+  if (sc) glScalef(0.5 / sc->size, 0.5 / sc->size, 0.5 / sc->size);
+  frustum_get(&f);
+  glGetFloatv(GL_MODELVIEW_MATRIX, view);
+  glGetFloatv(GL_PROJECTION_MATRIX, proj);
+  glPopMatrix();
+
+  if (!sc) {
+    snake_kinematics(shown->shape.node, shown->explode, node_mat, com);
+    snake_extent(node_mat, com, centre, box, &radius);
+  }
+
+  /* choose the nodes in view */
+  for (s = 0; s < count; s++) {
+    const float *place = sc ? sc->place[s] : origin;
+    float(*c)[3] = centre;
+    unsigned char *lod = glc->lod;
+    int in;
+
+    if (sc) {
+      scene_pose(sc, s);
+      c = sc->centre[s];
+      lod = sc->lod[s];
+      radius = sc->radius[s];
+    }
+    if ((in = frustum_sphere(&f, place, radius)) == FRUSTUM_OUT) {
+      cull.culled += NODE_COUNT;
+      continue;
+    }
+    for (i = 0; i < NODE_COUNT; i++) {
+      float p[3];
+
+      if (node_detail(&f, in, c, place, i, lod) == LOD_CULLED) continue;
+      for (k = 0; k < 3; k++) p[k] = c[i][k] + place[k];
+      depth[visible] = frustum_depth(&f, p);
+      order[visible++] = s * NODE_COUNT + i;
+    }
+  }
+  if (sc) sc->gap = shown->explode;
+  if (depth_sorted()) depth_sort(depth, order, visible);
+
+  /* bin them */
+  soft.triangles = 0;
+  for (k = 0; k < soft.tiles_x * soft.tiles_y; k++) soft.bin[k].count = 0;
+  for (n = 0; n < visible; n++) {
+    float placed[16], eye[16];
+    const float *place = origin, *mass = com;
+    float(*colours)[4] = shown->colour;
+    int plain;
+
+    s = order[n] / NODE_COUNT;
+    i = order[n] % NODE_COUNT;
+    if (sc) {
+      memcpy(placed, sc->node_mat[s][i], sizeof(placed));
+      place = sc->place[s];
+      mass = sc->com[s];
+      colours = shown->scene_colour[s];
+      plain = sc->lod[s][i] != LOD_FULL;
+    } else {
+      memcpy(placed, node_mat[i], sizeof(placed));
+      plain = glc->lod[i] != LOD_FULL;
+    }
+    for (k = 0; k < 3; k++) placed[12 + k] += place[k] - mass[k];
+    soft_multiply(eye, view, placed);
+    soft_node(eye, proj, plain, colours[(i + 1) % 2]);
+  }
+
+  soft_render();
+  soft_blit();
+}
+
+/* Draw every snake in the scene.  Each node is an instance of the same
+ * display list, placed by its own transform. */
+static void scene_display(void) {
+  struct snake_scene *sc = scene;
+  float scale = 0.5 / sc->size;
+  /* occlusion queries only work when nearer snakes hide the ones behind */
+  int occlude = occlusion && !transparent && !wireframe;
+  int sorted = depth_sorted(), visible = 0;
+  struct frustum f;
+  int n, s, i, parity;
+
+#ifdef GL_VERSION_3_1
+  if (glsl_active()) {
+    /* whole snakes out of view are still left out */
+    glsl_begin(scale);
+    frustum_get(&f);
+    for (s = 0; s < sc->count; s++) {
+      scene_pose(sc, s);
+      if (frustum_sphere(&f, sc->place[s], sc->radius[s]) == FRUSTUM_OUT) {
+        cull.culled += NODE_COUNT;
+        continue;
+      }
+      glsl_snake(sc->node_mat[s], sc->com[s], shown->scene_colour[s],
+                 sc->place[s]);
+    }
+    sc->gap = shown->explode;
+    glsl_end();
+    return;
+  }
+#endif
+
+  glPushMatrix();
+
+#ifdef HAVE_GLUT
+  /* apply the mouse drag rotation */
+  ui_mousedrag();
+#endif
+
+  /* apply the continuous rotation */
+  glRotatef(shown->yspin, 0.0, 1.0, 0.0);
+  glRotatef(shown->zspin, 0.0, 0.0, 1.0);
+
+  /* shrink the scene to about the size of a single snake */
+  glScalef(scale, scale, scale);
+
+  frustum_get(&f);
+  if (occlude) scene_sort(sc, &f);
+#ifdef GL_VERSION_1_5
+  if (occlude && !sc->query[0]) glGenQueries(sc->count, sc->query);
+#endif
+
+  for (n = 0; n < sc->count; n++) {
+    int in;
+#ifdef GL_VERSION_1_5
+    int querying = 0;
+#endif
+
+    s = sc->order[n];
+    scene_pose(sc, s);
+
+    /* the snake's sphere is centred on its place in the scene */
+    if ((in = frustum_sphere(&f, sc->place[s], sc->radius[s])) ==
+        FRUSTUM_OUT) {
+      cull.culled += NODE_COUNT;
+      continue;
+    }
+
+    /* sorted nodes are all drawn together afterwards */
+    if (sorted) {
+      for (i = 0; i < NODE_COUNT; i++) {
+        float c[3];
+        int k;
+
+        if (node_detail(&f, in, sc->centre[s], sc->place[s], i, sc->lod[s]) ==
+            LOD_CULLED)
+          continue;
+        for (k = 0; k < 3; k++) c[k] = sc->centre[s][i][k] + sc->place[s][k];
+        sc->node_depth[visible] = frustum_depth(&f, c);
+        sc->node_order[visible++] = s * NODE_COUNT + i;
+      }
+      continue;
+    }
+
+    glPushMatrix();
+    glTranslatef(sc->place[s][0] - sc->com[s][0],
+                 sc->place[s][1] - sc->com[s][1],
+                 sc->place[s][2] - sc->com[s][2]);
+
+#ifdef GL_VERSION_1_5
+    if (occlude) {
+      /* only ask again once the last answer is in */
+      scene_query_result(sc, s);
+      querying = !sc->pending[s];
+      if (querying) glBeginQuery(GL_SAMPLES_PASSED, sc->query[s]);
+      sc->pending[s] = 1;
+      if (sc->hidden[s]) {
+        /* see if the box round it has come into view for next time */
+        glPushMatrix();
+        glTranslatef(sc->com[s][0], sc->com[s][1], sc->com[s][2]);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        gls_depth_mask(0);
+        draw_box(sc->extent[s]);
+        gls_depth_mask(1);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glPopMatrix();
+        if (querying) glEndQuery(GL_SAMPLES_PASSED);
+        cull.occluded += NODE_COUNT;
+        glPopMatrix();
+        continue;
+      }
+    }
+#endif
+
+    /* draw all the nodes of one colour, then the other */
+    for (parity = 0; parity < 2; parity++) {
+      if (wireframe) {
+        glColor4fv(shown->scene_colour[s][parity]);
+      } else {
+        gls_material(GL_AMBIENT, shown->scene_colour[s][parity]);
+        gls_material(GL_DIFFUSE, shown->scene_colour[s][parity]);
+      }
+      for (i = 1 - parity; i < NODE_COUNT; i += 2) {
+        int lod = node_detail(&f, in, sc->centre[s], sc->place[s], i,
+                              sc->lod[s]);
+
+        if (lod == LOD_CULLED) continue;
+        glPushMatrix();
+        glMultMatrixf(sc->node_mat[s][i]);
+        gls_call_list(node_list(lod));
+        glPopMatrix();
+      }
+    }
+
+#ifdef GL_VERSION_1_5
+    if (querying) glEndQuery(GL_SAMPLES_PASSED);
+#endif
+    glPopMatrix();
+  }
+  sc->gap = shown->explode;
+
+  if (sorted) {
+    depth_sort(sc->node_depth, sc->node_order, visible);
+    /* everything behind has been drawn already, so don't hide it */
+    gls_depth_mask(0);
+    for (n = 0; n < visible; n++) {
+      float *rgba;
+
+      s = sc->node_order[n] / NODE_COUNT;
+      i = sc->node_order[n] % NODE_COUNT;
+      rgba = shown->scene_colour[s][(i + 1) % 2];
+      gls_material(GL_AMBIENT, rgba);
+      gls_material(GL_DIFFUSE, rgba);
+      glPushMatrix();
+      glTranslatef(sc->place[s][0] - sc->com[s][0],
+                   sc->place[s][1] - sc->com[s][1],
+                   sc->place[s][2] - sc->com[s][2]);
+      glMultMatrixf(sc->node_mat[s][i]);
+      gls_call_list(node_list(sc->lod[s][i]));
+      glPopMatrix();
+    }
+    gls_depth_mask(1);
+  }
+
+  glPopMatrix();
+}
+
+/* frame rate reporting for benchmark mode */
+#define BENCH_INTERVAL 5000
+
+static struct {
+  snaketime start;
+  long frames;
+  /* the scene's morph counts at the last report */
+  long replanned, rejected;
+} bench;
+
+/* milliseconds from one time to another */
+static long elapsed_msec(const snaketime *from, const snaketime *to) {
+  return (long)GETMSECS(*to) - GETMSECS(*from) +
+         ((long)GETSECS(*to) - GETSECS(*from)) * 1000L;
+}
+
+/* count a frame, and report the frame rate every BENCH_INTERVAL msecs */
+static void bench_frame(void) {
+  snaketime now;
+  long msec;
+
+  gettime(&now);
+  if (bench.frames++ == 0) {
+    memcpy(&bench.start, &now, sizeof(snaketime));
+    memset(&cull, 0, sizeof(cull));
+    gls.calls = gls.changes = gls.draws = 0;
+    transparency_cost = 0;
+    soft.drawn = 0;
+    return;
+  }
+  msec = elapsed_msec(&bench.start, &now);
+  if (msec < BENCH_INTERVAL) return;
+
+  fprintf(stderr, "glsnake: %d snake%s, %.1f fps, %.2f ms/frame\n",
+          scene ? scene->count : 1, scene ? "s" : "",
+          (bench.frames - 1) * 1000.0 / msec,
+          (double)msec / (bench.frames - 1));
+  if (scene) {
+    fprintf(stderr, "glsnake: %ld morphs replanned, %ld rejected\n",
+            shown->replanned - bench.replanned,
+            shown->rejected - bench.rejected);
+    bench.replanned = shown->replanned;
+    bench.rejected = shown->rejected;
+  }
+  fprintf(stderr,
+          "glsnake: %.1f nodes drawn, %.1f culled, %.1f occluded a frame\n",
+          (double)(cull.drawn[LOD_FULL] + cull.drawn[LOD_PLAIN] +
+                   cull.drawn[LOD_POINT]) / (bench.frames - 1),
+          (double)cull.culled / (bench.frames - 1),
+          (double)cull.occluded / (bench.frames - 1));
+  fprintf(stderr, "glsnake: %.1f full, %.1f plain, %.1f point nodes a frame\n",
+          (double)cull.drawn[LOD_FULL] / (bench.frames - 1),
+          (double)cull.drawn[LOD_PLAIN] / (bench.frames - 1),
+          (double)cull.drawn[LOD_POINT] / (bench.frames - 1));
+  if (transparent) {
+    static const char *const method[] = {"chain order", "sorted",
+                                         "weighted blended"};
+
+    fprintf(stderr, "glsnake: %.3f ms/frame on %s transparency\n",
+            transparency_cost / 1e6 / (bench.frames - 1),
+            method[glsl_active() && glsl_weighted_active()
+                       ? TRANSPARENCY_WEIGHTED
+                       : depth_sorted() ? TRANSPARENCY_SORTED
+                                        : TRANSPARENCY_CHAIN]);
+    transparency_cost = 0;
+  }
+  if (soft_active()) {
+    int threads = 1;
+
+#ifdef HAVE_PTHREAD
+    threads += soft.threads;
+#endif
+    fprintf(stderr, "glsnake: %.1f triangles a frame on %d software thread%s\n",
+            (double)soft.drawn / (bench.frames - 1), threads,
+            threads > 1 ? "s" : "");
+    soft.drawn = 0;
+  }
+  fprintf(stderr,
+          "glsnake: %.1f GL state calls, %.1f passed on, %.1f draws a frame\n",
+          (double)gls.calls / (bench.frames - 1),
+          (double)gls.changes / (bench.frames - 1),
+          (double)gls.draws / (bench.frames - 1));
+  gls.calls = gls.changes = gls.draws = 0;
+  memset(&cull, 0, sizeof(cull));
+  memcpy(&bench.start, &now, sizeof(snaketime));
+  bench.frames = 1;
+}
+
+/*
+ * The simulation.  It steps the snakes on a thread of its own, in fixed
+ * steps of SIM_STEP msecs of simulated time, so it plays out the same at
+ * any frame rate, and hands a copy of each result to the renderer through
+ * a triple buffer, so neither ever waits for the other.  The renderer
+ * draws one step behind, blending the last two states it was handed by
+ * how far it is between them.  Keys that change the simulation reach it
+ * through a queue.  Without threads it is stepped from the idle function
+ * instead, through the same hand over.
+ */
+
+/* msecs of simulated time in a step */
+#define SIM_STEP 10
+#define SIM_STEP_NSEC (SIM_STEP * 1000000LL)
+/* how far behind the simulation may fall before it stops catching up */
+#define SIM_BEHIND (25 * SIM_STEP_NSEC)
+/* set on sim.middle while it holds a state that hasn't been drawn */
+#define SIM_FRESH 4
+/* keys that can wait for the simulation, and the mark on special keys */
+#define SIM_KEYS 64
+#define SIM_SPECIAL 0x100
+
+#ifdef HAVE_PTHREAD
+#define SIM_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define SIM_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define SIM_SWAP(p, v) __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL)
+#else
+#define SIM_LOAD(p) (*(p))
+#define SIM_STORE(p, v) (*(p) = (v))
+#define SIM_SWAP(p, v) sim_swap(p, v)
+
+static int sim_swap(int *p, int v) {
+  int old = *p;
+
+  *p = v;
+  return old;
+}
+#endif
+
+static struct {
+  /* the simulation fills state[back] while the renderer draws
+   * state[front], and each swaps with middle when it is done */
+  struct sim_state state[3];
+  int back, middle, front;
+  /* when the next step is due */
+  long long due;
+  /* the renderer's copy of the state before front, and the blend of the
+   * two it draws; is it still part way between them? */
+  struct sim_state prev, view;
+  int blending;
+  /* when the renderer last drew, and is the window out of sight? */
+  long long drawn;
+  int hidden;
+  /* keys from the UI, which only it adds at head and only the simulation
+   * takes from tail */
+  int key[SIM_KEYS];
+  unsigned int head, tail;
+  /* steps taken and keys acted on since the start, which a recorded
+   * session times keys and frames by */
+  unsigned long steps, keys;
+#ifdef PROFILE
+  /* when each key was pressed, and the newest one acted on */
+  long long key_at[SIM_KEYS], input;
+#endif
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+  int running, stop;
+  /* the simulation thread waits on wake while there is nothing to do */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+#endif
+} sim;
+
+/* Keep a spin angle within a turn.  Left to grow, it runs out of precision
+ * for the small steps it takes: in a float, within a few days they round
+ * to other sizes and, in a month or so, to nothing. */
+static double spin_wrap(double a) {
+  return a >= 360.0 ? a - 360.0 : a < 0.0 ? a + 360.0 : a;
+}
+
+/* the spin angle t of the way from one to another, the short way round */
+static GLfloat spin_blend(GLfloat from, GLfloat to, float t) {
+  GLfloat d = to - from;
+
+  if (d > 180.0)
+    d -= 360.0;
+  else if (d < -180.0)
+    d += 360.0;
+  return spin_wrap(from + d * t);
+}
+
+/* advance the simulation by a step; returns 0 if nothing moved */
+static int sim_step(void) {
+  /* time since last iteration */
+  long iter_msec = SIM_STEP;
+  int still_morphing;
+
+  sim.steps++;
+
+  /* Do nothing to the model if we are paused */
+  if (glc->paused) return 0;
+
+  /* work out if we have to switch models */
+  glc->morph_clock += iter_msec;
+
+  if (scene) {
+    PROF_BEGIN(PROF_STEP);
+    scene_idle(iter_msec);
+    PROF_END(PROF_STEP);
+    yspin = spin_wrap(yspin + 360 / ((1000 / yangvel) / iter_msec));
+    zspin = spin_wrap(zspin + 360 / ((1000 / zangvel) / iter_msec));
+    return 1;
+  }
+
+  if ((glc->morph_clock > statictime) && !interactive && !glc->morphing) {
+    /*printf("starting morph\n");*/
+    glc->morph_clock = 0;
+    start_morph(RAND(models), 0);
+  }
+
+  if (interactive && !glc->morphing) return 0;
+
+  /*	if (!glc->dragging && !glc->interactive) { */
+  if (!interactive) {
+    yspin = spin_wrap(yspin + 360 / ((1000 / yangvel) / iter_msec));
+    zspin = spin_wrap(zspin + 360 / ((1000 / zangvel) / iter_msec));
+    /*
+    yspin += 360 * (yangvel/1000.0) * iter_msec;
+    zspin += 360 * (zangvel/1000.0) * iter_msec;
+    */
+
+    /*printf("yspin: %f, zspin: %f\n", yspin, zspin);*/
+  }
+
+  PROF_BEGIN(PROF_STEP);
+  still_morphing = glc->morph(iter_msec);
+  PROF_END(PROF_STEP);
+
+  if (!still_morphing) {
+    glc->morphing = 0;
+  }
+
+  /* colour cycling */
+  morph_colour();
+
+  return 1;
+}
+
+/* Will nothing change until a key is pressed?  A scene keeps spinning
+ * even in interactive mode. */
+static int sim_still(void) {
+  return glc->paused || (!scene && interactive && !glc->morphing);
+}
+
+/* are there keys the simulation hasn't acted on? */
+static int sim_pending(void) { return SIM_LOAD(&sim.head) != sim.tail; }
+
+/* wake the simulation thread if it is waiting */
+static void sim_wake(void) {
+#ifdef HAVE_PTHREAD
+  if (!sim.running) return;
+  pthread_mutex_lock(&sim.lock);
+  pthread_cond_signal(&sim.wake);
+  pthread_mutex_unlock(&sim.lock);
+#endif
+}
+
+#ifdef HAVE_GLUT
+/* act on a key, on the simulation thread, and record when it was */
+static void sim_command(int key) {
+  session_put(SESSION_KEY, sim.steps, key, 0, 0);
+  sim.keys++;
+  if (key & SIM_SPECIAL)
+    ui_special_command(key & ~SIM_SPECIAL);
+  else
+    ui_key_command(key);
+}
+#endif
+
+/* act on the keys queued since the last step; returns 0 if there were
+ * none */
+static int sim_input(void) {
+#ifdef HAVE_GLUT
+  unsigned int head = SIM_LOAD(&sim.head), tail = sim.tail;
+
+  if (tail == head) return 0;
+  for (; tail != head; tail++) {
+#ifdef PROFILE
+    sim.input = sim.key_at[tail % SIM_KEYS];
+    prof_record(PROF_KEY_STEP, real_nsec() - sim.input);
+#endif
+    sim_command(sim.key[tail % SIM_KEYS]);
+  }
+  SIM_STORE(&sim.tail, tail);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+#ifdef HAVE_GLUT
+/* queue a key for the simulation, dropping it if the queue is full */
+static void sim_post(int key) {
+  unsigned int head = sim.head;
+
+  /* a replay's keys come from the session, at the steps they were acted
+   * on */
+  if (session.in) return;
+  if (head - SIM_LOAD(&sim.tail) == SIM_KEYS) return;
+  sim.key[head % SIM_KEYS] = key;
+#ifdef PROFILE
+  sim.key_at[head % SIM_KEYS] = real_nsec();
+#endif
+  SIM_STORE(&sim.head, head + 1);
+  sim_wake();
+  glutIdleFunc(glsnake_idle);
+}
+#endif
+
+/* copy what the renderer needs into the back state and hand it over */
+static void sim_publish(void) {
+  struct sim_state *st = &sim.state[sim.back];
+  struct snake_scene *sc = scene;
+
+  memcpy(&st->shape, &glc->shape, sizeof(st->shape));
+  memcpy(st->colour, glc->colour, sizeof(st->colour));
+  st->name = glc->next_model_s.name;
+  st->selected = glc->selected;
+  st->morphing = glc->morphing;
+  st->progress = glc->morphing ? glc->morph_percent() : 1.0;
+  st->legal = glc->metrics.is_legal;
+  if (sc) {
+    int s;
+
+    for (st->progress = 0.0, s = 0; s < sc->count; s++)
+      st->progress += sc->progress[s] / sc->count;
+    memcpy(st->angle, sc->angle, sc->count * NODE_COUNT * sizeof(int));
+    memcpy(st->scene_colour, sc->colour, sc->count * sizeof(*sc->colour));
+    st->replanned = sc->replanned;
+    st->rejected = sc->rejected;
+  }
+  st->yspin = yspin;
+  st->zspin = zspin;
+  st->explode = explode;
+  st->interactive = interactive;
+  st->still = sim_still();
+  st->steps = sim.steps;
+  st->keys = sim.keys;
+#ifdef PROFILE
+  st->input = sim.input;
+#endif
+  /* the last step was due a step ago */
+  st->stamp = sim.due - SIM_STEP_NSEC;
+
+  sim.back = SIM_SWAP(&sim.middle, sim.back | SIM_FRESH) & ~SIM_FRESH;
+}
+
+/* is there a state the renderer hasn't drawn yet? */
+static int sim_fresh(void) { return SIM_LOAD(&sim.middle) & SIM_FRESH; }
+
+/* copy one state over another, but not the move counts */
+static void sim_copy(struct sim_state *to, const struct sim_state *from) {
+  memcpy(&to->shape, &from->shape, sizeof(to->shape));
+  memcpy(to->colour, from->colour, sizeof(to->colour));
+  to->name = from->name;
+  to->selected = from->selected;
+  to->morphing = from->morphing;
+  to->progress = from->progress;
+  to->legal = from->legal;
+  if (scene) {
+    memcpy(to->angle, from->angle, scene->count * NODE_COUNT * sizeof(int));
+    memcpy(to->scene_colour, from->scene_colour,
+           scene->count * sizeof(*to->scene_colour));
+  }
+  to->replanned = from->replanned;
+  to->rejected = from->rejected;
+  to->yspin = from->yspin;
+  to->zspin = from->zspin;
+  to->explode = from->explode;
+  to->interactive = from->interactive;
+  to->stamp = from->stamp;
+  to->still = from->still;
+  to->steps = from->steps;
+  to->keys = from->keys;
+#ifdef PROFILE
+  to->input = from->input;
+#endif
+}
+
+/* blend a snake's joints and colours t of the way from one pose to
+ * another; returns 0 if the result is what was there already */
+static int sim_blend_snake(int *angle, float (*rgba)[4], const int *from,
+                           float (*from_rgba)[4], const int *to,
+                           float (*to_rgba)[4], float t) {
+  int i, k, changed = 0;
+
+  for (i = 0; i < NODE_COUNT; i++) {
+    int a = (from[i] + (int)(joint_delta(from[i], to[i]) * t)) & ANGLE_MASK;
+
+    changed |= a != angle[i];
+    angle[i] = a;
+  }
+  for (k = 0; k < 4; k++) {
+    rgba[0][k] = from_rgba[0][k] + (to_rgba[0][k] - from_rgba[0][k]) * t;
+    rgba[1][k] = from_rgba[1][k] + (to_rgba[1][k] - from_rgba[1][k]) * t;
+  }
+  return changed;
+}
+
+/* pick up the newest state, if there is one, keeping the one before;
+ * returns the newest */
+static struct sim_state *sim_take(void) {
+  if (sim_fresh()) {
+    sim_copy(&sim.prev, &sim.state[sim.front]);
+    sim.front = SIM_SWAP(&sim.middle, sim.front) & ~SIM_FRESH;
+  }
+  return &sim.state[sim.front];
+}
+
+/* show the state t of the way from the one before to the newest */
+static void sim_blend(float t) {
+  struct sim_state *from = &sim.prev, *to = &sim.state[sim.front];
+  struct sim_state *v = &sim.view;
+  int s;
+
+  sim.blending = t < 1.0;
+  sim_copy(v, to);
+  sim_blend_snake(v->shape.node, v->colour, from->shape.node, from->colour,
+                  to->shape.node, to->colour, t);
+  v->yspin = spin_blend(from->yspin, to->yspin, t);
+  v->zspin = spin_blend(from->zspin, to->zspin, t);
+  for (s = 0; scene && s < scene->count; s++)
+    v->moved[s] += sim_blend_snake(
+        v->angle + s * NODE_COUNT, v->scene_colour[s],
+        from->angle + s * NODE_COUNT, from->scene_colour[s],
+        to->angle + s * NODE_COUNT, to->scene_colour[s], t);
+  shown = v;
+}
+
+#ifdef HAVE_GLUT
+/* add what a frame shows to the session's hash */
+static void session_shown(void) {
+  int i, n = scene ? scene->count * NODE_COUNT : 0;
+
+  for (i = 0; i < NODE_COUNT; i++) session_hash(shown->shape.node[i]);
+  for (i = 0; i < n; i++) session_hash(shown->angle[i]);
+  session_hash(session_bits(shown->yspin));
+  session_hash(session_bits(shown->zspin));
+  session.frames++;
+}
+#endif
+
+/* Pick up the newest state, and draw a step behind it from now on: the
+ * blend of it and the one before at where now falls between them. */
+static void sim_acquire(void) {
+  struct sim_state *from = &sim.prev, *to = sim_take();
+  long long now = gettime_nsec();
+  float t = 1.0;
+
+  if (to->stamp > from->stamp)
+    t = (float)(now - SIM_STEP_NSEC - from->stamp) / (to->stamp - from->stamp);
+  t = MAX(0.0, MIN(t, 1.0));
+  sim.drawn = now;
+  sim_blend(t);
+
+#ifdef HAVE_GLUT
+  if (session.out) {
+    session_shown();
+    session_put(SESSION_FRAME, to->steps, to->keys, session_bits(t),
+                (now - session.last) / 1000);
+    session.last = now;
+  }
+#endif
+}
+
+/* take in keys, catch up on the steps due, and publish the result if
+ * anything changed; returns 0 if nothing did */
+static int sim_tick(void) {
+  long long now = gettime_nsec();
+  int changed = sim_input();
+
+  /* after a long stall, such as a pause, start again from now rather than
+   * racing through the time lost */
+  if (now - sim.due > SIM_BEHIND) sim.due = now;
+  for (; sim.due <= now; sim.due += SIM_STEP_NSEC)
+    if (sim_step()) changed = 1;
+  if (changed) sim_publish();
+  return changed;
+}
+
+#ifdef HAVE_PTHREAD
+/* Step the simulation as each step falls due.  While the window is hidden,
+ * or nothing can change until a key is pressed, wait for sim_wake
+ * instead, and carry on from then as if no time had passed. */
+static void *sim_thread(void *unused ATTRIBUTE_UNUSED) {
+  while (!SIM_LOAD(&sim.stop)) {
+    sim_tick();
+
+    pthread_mutex_lock(&sim.lock);
+    if ((SIM_LOAD(&sim.hidden) || sim_still()) && !sim_pending()) {
+      while (!SIM_LOAD(&sim.stop) &&
+             (SIM_LOAD(&sim.hidden) || sim_still()) && !sim_pending())
+        pthread_cond_wait(&sim.wake, &sim.lock);
+      sim.due = gettime_nsec();
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    sleep_until_nsec(sim.due);
+  }
+  return NULL;
+}
+
+/* stop the simulation thread, before the scene goes away */
+static void sim_stop(void) {
+  if (!sim.running) return;
+  SIM_STORE(&sim.stop, 1);
+  sim_wake();
+  pthread_join(sim.thread, NULL);
+  sim.running = 0;
+}
+#endif
+
+/* make room for a scene in a state */
+static int sim_alloc(struct sim_state *st) {
+  st->angle = calloc(scene->count * NODE_COUNT, sizeof(int));
+  st->scene_colour = calloc(scene->count, sizeof(*st->scene_colour));
+  st->moved = calloc(scene->count, sizeof(unsigned int));
+  return st->angle && st->scene_colour && st->moved;
+}
+
+/* make room for a scene in the states, publish the first one and start
+ * the thread */
+static void sim_init(void) {
+  int i, ok = 1;
+
+  if (shown) return;
+  for (i = 0; scene && i < 3; i++) ok &= sim_alloc(&sim.state[i]);
+  if (scene) ok &= sim_alloc(&sim.prev) & sim_alloc(&sim.view);
+  if (!ok) {
+    fprintf(stderr, "glsnake: out of memory for %d snakes\n", scene->count);
+    exit(1);
+  }
+  sim.back = 0;
+  sim.middle = 1;
+  sim.front = 2;
+  sim.due = gettime_nsec();
+  sim_publish();
+  sim_acquire();
+
+#ifdef HAVE_GLUT
+  /* a replay steps the simulation itself, as the session says, and so
+   * do a soak test and an export, on the virtual clock */
+  if (session.in || soak || film.format || sheet.path || meshes.path) return;
+#endif
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init(&sim.lock, NULL);
+  pthread_cond_init(&sim.wake, NULL);
+  sim.running = !pthread_create(&sim.thread, NULL, sim_thread, NULL);
+#endif
+}
+
+/* Draw only when there is something new to show, no more often than
+ * -max-fps allows, and not at all while the window is hidden.  When
+ * nothing will change until a key is pressed, stop idling altogether. */
+void glsnake_idle(
+#ifndef HAVE_GLUT
+    struct glsnake_cfg *bp ATTRIBUTE_UNUSED
+#endif
+) {
+#ifdef HAVE_GLUT
+  long long wake;
+#endif
+  int running = 0;
+
+#ifdef HAVE_GLUT
+  if (session.in) {
+    session_idle();
+    return;
+  }
+#endif
+
+  PROF_BEGIN(PROF_IDLE);
+#ifdef HAVE_PTHREAD
+  running = sim.running;
+#endif
+  if (!running) sim_tick();
+  PROF_END(PROF_IDLE);
+  PROF_POLL();
+
+#ifdef HAVE_GLUT
+  if (sim.hidden) {
+    glutIdleFunc(NULL);
+    return;
+  }
+
+  if (benchmark || sim.blending || sim_fresh()) {
+    if (maxfps > 0) sleep_until_nsec(sim.drawn + 1000000000LL / maxfps);
+    glutPostRedisplay();
+    return;
+  }
+
+  if (shown->still && !sim_pending()) {
+    glutIdleFunc(NULL);
+    return;
+  }
+
+  /* wait for the next step to be published */
+  if (running) {
+    wake = shown->stamp + SIM_STEP_NSEC;
+    sleep_until_nsec(MAX(wake, gettime_nsec() + SIM_STEP_NSEC / 4));
+  } else {
+    sleep_until_nsec(sim.due);
+  }
+#endif
+}
+
+/* wot draws it */
+void glsnake_display(
+#ifndef HAVE_GLUT
+    ModeInfo *mi
+#endif
+) {
+#ifndef HAVE_GLUT
+  struct glsnake_cfg *bp = &glc[MI_SCREEN(mi)];
+  Display *dpy = MI_DISPLAY(mi);
+  Window window = MI_WINDOW(mi);
+#endif
+  int i;
+  float node_mat[NODE_COUNT][16]; /* transform of each node */
+  float com[3];                   /* it's the CENTRE of MASS */
+  float centre[NODE_COUNT][3], box[2][3], radius; /* for culling */
+  static const float origin[3] = {0.0, 0.0, 0.0};
+  struct frustum f;
+  int in, lod[NODE_COUNT];
+  int order[NODE_COUNT], visible, n;
+  float depth[NODE_COUNT];
+
+#ifndef HAVE_GLUT
+  if (!bp->glx_context) return;
+#endif
+
+  PROF_BEGIN(PROF_FRAME);
+#ifdef HAVE_GLUT
+  /* a replay brings each frame in before asking for it to be drawn */
+  if (!session.in) sim_acquire();
+  session.due = 0;
+  ui_drag();
+#else
+  sim_acquire();
+#endif
+  PROF_BEGIN(PROF_DRAW);
+  PROF_GPU(PROF_MARK_START);
+
+  /* clear the buffer */
+  glClear((GLbitfield)GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  /* go into the modelview stack */
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+
+  if (soft_active()) {
+    soft_display();
+  } else if (scene) {
+    scene_display();
+#ifdef GL_VERSION_3_1
+  } else if (glsl_active()) {
+    snake_kinematics(shown->shape.node, shown->explode, node_mat, com);
+    glsl_begin(1.0);
+    glsl_snake(node_mat, com, shown->colour, origin);
+    glsl_end();
+#endif
+#ifdef GL_VERSION_1_5
+  } else if (bake_ready()) {
+    glPushMatrix();
+#ifdef HAVE_GLUT
+    ui_mousedrag();
+#endif
+    glRotatef(shown->yspin, 0.0, 1.0, 0.0);
+    glRotatef(shown->zspin, 0.0, 0.0, 1.0);
+    bake_draw();
+    glPopMatrix();
+#endif
+  } else {
+    /* get the transform of each node, by moving through the snake and
+     * performing the rotations, and the centre of mass from those */
+    snake_kinematics(shown->shape.node, shown->explode, node_mat, com);
+
+    glPushMatrix();
+
+#ifdef HAVE_GLUT
+    /* apply the mouse drag rotation */
+    ui_mousedrag();
+#endif
+
+    /* apply the continuous rotation */
+    glRotatef(shown->yspin, 0.0, 1.0, 0.0);
+    glRotatef(shown->zspin, 0.0, 0.0, 1.0);
+
+    /* cull against the view with the snake's centre of mass at the origin */
+    frustum_get(&f);
+    snake_extent(node_mat, com, centre, box, &radius);
+    in = frustum_sphere(&f, origin, radius);
+
+    /* spin about the centre of mass */
+    glTranslatef(-com[0], -com[1], -com[2]);
+
+#if MAGICAL_RED_STRING
+    glDisable(GL_LIGHTING);
+    glColor4f(1.0, 0.0, 0.0, 1.0);
+    glBegin(GL_LINE_STRIP);
+    for (i = 0; i < NODE_COUNT - 1; i++) {
+      float *m = node_mat[i];
+
+      glVertex3f(0.5 * (m[0] + m[4] + m[8]) + m[12],
+                 0.5 * (m[1] + m[5] + m[9]) + m[13],
+                 0.5 * (m[2] + m[6] + m[10]) + m[14]);
+    }
+    glEnd();
+    glEnable(GL_LIGHTING);
+#endif
+
+    /* choose the nodes in view, and draw them along the snake, or far to
+     * near for sorted transparency */
+    for (i = visible = 0; i < NODE_COUNT; i++) {
+      if ((lod[i] = node_detail(&f, in, centre, origin, i, glc->lod)) ==
+          LOD_CULLED)
+        continue;
+      depth[visible] = frustum_depth(&f, centre[i]);
+      order[visible++] = i;
+    }
+    if (depth_sorted()) {
+      depth_sort(depth, order, visible);
+      gls_depth_mask(0);
+    } else if (!transparent) {
+      order_by_colour(order, visible);
+    }
+
+    /* now draw each node */
+    for (n = 0; n < visible; n++) {
+      i = order[n];
+
+      /* choose a colour for this node */
+      if ((i == shown->selected || i == shown->selected + 1) &&
+          shown->interactive)
+        if (wireframe) {
+          glColor4fv(yellow_light);
+        } else {
+          gls_material(GL_DIFFUSE, yellow_light);
+        }
+      else {
+        if (wireframe) {
+          glColor4fv(shown->colour[(i + 1) % 2]);
+        } else {
+          gls_material(GL_AMBIENT, shown->colour[(i + 1) % 2]);
+          gls_material(GL_DIFFUSE, shown->colour[(i + 1) % 2]);
+          /*glMaterialfv(GL_FRONT, GL_SPECULAR, glc->colour[(i+1)%2]);*/
+        }
+      }
+
+      /* draw the node */
+      glPushMatrix();
+      glMultMatrixf(node_mat[i]);
+      gls_call_list(node_list(lod[i]));
+      glPopMatrix();
+    }
+    gls_depth_mask(1);
+
+    glPopMatrix();
+  }
+
+  PROF_END(PROF_DRAW);
+  PROF_GPU(PROF_MARK_DRAWN);
+  PROF_TRACE_DRAWN();
+
+  PROF_BEGIN(PROF_TITLE);
+  hud_frame(sim.drawn);
+  if (titles || hud)
+#ifdef HAVE_GLUT
+    draw_title();
+#else
+    draw_title(mi);
 #endif
+  PROF_END(PROF_TITLE);
+  PROF_GPU(PROF_MARK_TITLED);
+
+#ifndef HAVE_GLUT
+  glsnake_idle(bp);
+  /* xscreensaver waits mi->pause microseconds before the next frame, so
+   * wait longer while nothing moves or to keep under -maxfps */
+  mi->pause = bp->delay;
+  if (shown->still && !sim.blending)
+    mi->pause = MAX(mi->pause, 100000UL);
+  else if (maxfps > 0)
+    mi->pause = MAX(mi->pause, 1000000UL / maxfps);
+#endif
+
+  PROF_BEGIN(PROF_SWAP);
+  glFlush();
+#ifdef HAVE_GLUT
+  /* exported frames stay off screen */
+  if (!film.format) glutSwapBuffers();
+#else
+  glXSwapBuffers(dpy, window);
+#endif
+  PROF_END(PROF_SWAP);
+  PROF_END(PROF_FRAME);
+  PROF_TRACE_SWAPPED();
+
+  if (benchmark) bench_frame();
+  PROF_POLL();
+}
+
+#ifdef HAVE_GLUT
+/* open the session to replay, and read the seed, the day and the options
+ * it was recorded with */
+static void session_open(void) {
+  char magic[sizeof(SESSION_MAGIC) - 1], arg[SESSION_ARG];
+  unsigned long w[4];
+  int i, n, c;
+
+  if ((session.in = fopen(session.replay, "rb")) == NULL) {
+    fprintf(stderr, "glsnake: can't open %s: %s\n", session.replay,
+            strerror(errno));
+    exit(1);
+  }
+  if (fread(magic, 1, sizeof(magic), session.in) != sizeof(magic) ||
+      memcmp(magic, SESSION_MAGIC, sizeof(magic)) ||
+      session_get(w) != SESSION_START || w[0] != SESSION_VERSION ||
+      w[3] > SESSION_ARGS) {
+    fprintf(stderr, "glsnake: %s isn't a session this glsnake can replay\n",
+            session.replay);
+    exit(1);
+  }
+  session.seed = w[1];
+  session.spooky = w[2];
+  session.latched = 1;
+  session.argc = w[3];
+  if ((session.argv = calloc(session.argc + 1, sizeof(char *))) == NULL) {
+    fprintf(stderr, "glsnake: out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < session.argc; i++) {
+    for (n = 0; (c = getc(session.in)) > 0 && n < SESSION_ARG - 1; n++)
+      arg[n] = c;
+    arg[n] = '\0';
+    if (c != 0 || (session.argv[i] = malloc(n + 1)) == NULL) {
+      fprintf(stderr, "glsnake: can't read the options in %s\n",
+              session.replay);
+      exit(1);
+    }
+    strcpy(session.argv[i], arg);
+  }
+}
+
+/* start hashing what is shown, and recording, if asked to */
+static void session_start(int argc, char **argv) {
+  int i;
+
+  session.hash = SESSION_HASH;
+  session.start = session.last = real_nsec();
+  if (!session.record) return;
+
+  if ((session.out = fopen(session.record, "wb")) == NULL) {
+    fprintf(stderr, "glsnake: can't record to %s: %s\n", session.record,
+            strerror(errno));
+    exit(1);
+  }
+  fwrite(SESSION_MAGIC, 1, sizeof(SESSION_MAGIC) - 1, session.out);
+  session_put(SESSION_START, SESSION_VERSION, session.seed, session.spooky,
+              argc);
+  for (i = 0; i < argc; i++)
+    fwrite(argv[i], 1, strlen(argv[i]) + 1, session.out);
+}
+
+/* finish the recording, or say how the replay went */
+static void session_finish(void) {
+  double took = (real_nsec() - session.start) / 1e9;
+
+  if (session.out) {
+    session_put(SESSION_END, session.frames, session.hash, 0, 0);
+    if (ferror(session.out) | fclose(session.out))
+      fprintf(stderr, "glsnake: couldn't write all of %s\n", session.record);
+    else
+      fprintf(stderr, "glsnake: recorded %lu frames to %s, state %08lx\n",
+              session.frames, session.record, session.hash);
+    session.out = NULL;
+  }
+  if (session.in) {
+    fprintf(stderr,
+            "glsnake: replayed %lu frames of a %.2f s session in %.3f s, "
+            "%.1f frames a second, state %08lx%s\n",
+            session.frames, session.recorded / 1e9, took,
+            session.frames / MAX(took, 1e-9), session.hash,
+            !session.ended                     ? ""
+            : session.end_hash == session.hash ? " as recorded"
+                                               : ", NOT as recorded");
+    fclose(session.in);
+    session.in = NULL;
+  }
+}
+
+/*
+ * Soak testing.  -soak runs the simulation for that many hours on the
+ * virtual clock, with no window, handing over and blending frames at the
+ * -max-fps rate, or VIRTUAL_FPS, just as drawing them would.  Every simulated
+ * hour it reports what creeps up over a long run: how big glsnake has
+ * grown, the undo ring, how far the spin angles have drifted from where
+ * exact sums put them, and what a frame really costs.
+ */
+#define SOAK_HOUR (3600 * 1000000000LL)
+
+/* the most memory glsnake has had, in kB, where that can be found out */
+static long soak_memory(void) {
+#ifdef HAVE_GETRUSAGE
+  struct rusage ru;
+
+  if (!getrusage(RUSAGE_SELF, &ru)) return ru.ru_maxrss;
+#endif
+  return 0;
+}
+
+/* how far a spin angle is from start turned steps times by step */
+static double soak_drift(double spin, double start, GLfloat step,
+                         unsigned long steps) {
+  double d = fmod(start + (double)step * steps - spin, 360.0);
+
+  return d > 180.0 ? d - 360.0 : d < -180.0 ? d + 360.0 : d;
+}
+
+static void soak_run(void) {
+  long long frame = 1000000000LL / (maxfps > 0 ? maxfps : VIRTUAL_FPS);
+  long long began = real_nsec(), total, most, cost;
+  long iter_msec = SIM_STEP;
+  /* the steps sim_step spins by, worked out just as it does */
+  GLfloat ystep = 360 / ((1000 / yangvel) / iter_msec);
+  GLfloat zstep = 360 / ((1000 / zangvel) / iter_msec);
+  double ystart = yspin, zstart = zspin;
+  unsigned long frames;
+  int hour;
+
+  for (hour = 1; hour <= soak; hour++) {
+    for (frames = 0, total = most = 0; virtual_clock < hour * SOAK_HOUR;
+         frames++) {
+      cost = real_nsec();
+      sleep_until_nsec(virtual_clock + frame);
+      sim_tick();
+      sim_acquire();
+      cost = real_nsec() - cost;
+      total += cost;
+      most = MAX(most, cost);
+    }
+    fprintf(stderr,
+            "glsnake: soak hour %d: %lu frames at %.2f us, most %.1f us; "
+            "%ld kB; %d undo; spin drift %.2g, %.2g degrees\n",
+            hour, frames, total / 1e3 / frames, most / 1e3, soak_memory(),
+            (undo_ring_end - undo_ring_start + UNDO_LENGTH) % UNDO_LENGTH,
+            soak_drift(yspin, ystart, ystep, sim.steps),
+            soak_drift(zspin, zstart, zstep, sim.steps));
+  }
+  fprintf(stderr, "glsnake: soaked %d hours in %.1f s, %.0f times real time\n",
+          soak, (real_nsec() - began) / 1e9,
+          soak * 3600e9 / MAX(real_nsec() - began, 1));
+}
+
+/*
+ * Exporting frames.  -export draws -export-frames frames off screen, at
+ * -export-size, -max-fps or VIRTUAL_FPS frames a second apart on the
+ * virtual clock, and writes them to standard output as a PPM or Y4M
+ * stream, or a run of PNGs.  Each frame is read back into the next of a
+ * ring of pixel buffer objects and only mapped FILM_PBOS - 1 frames
+ * later, by when the copy is long done, so drawing never waits on it.
+ * Frames are encoded on a pool of threads, and written out in order as
+ * they finish.  GLUT only gives out a GL context with a window, so one is
+ * opened, and hidden.
+ */
+static void film_lock(void) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&film.lock);
+#endif
+}
+
+static void film_unlock(void) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&film.lock);
+#endif
+}
+
+/* put a 32 bit word out big endian, as PNG wants */
+static unsigned char *film_be32(unsigned char *out, unsigned long w) {
+  out[0] = (w >> 24) & 0xff;
+  out[1] = (w >> 16) & 0xff;
+  out[2] = (w >> 8) & 0xff;
+  out[3] = w & 0xff;
+  return out + 4;
+}
+
+/* finish a PNG chunk whose data is already in place after its length and
+ * type; returns the end of it */
+static unsigned char *film_chunk(unsigned char *out, const char *type,
+                                 size_t size) {
+  unsigned long crc = 0xffffffffUL;
+  size_t i;
+
+  film_be32(out, size);
+  memcpy(out + 4, type, 4);
+  for (i = 4; i < 8 + size; i++)
+    crc = film.crc[(crc ^ out[i]) & 0xff] ^ (crc >> 8);
+  return film_be32(out + 8 + size, crc ^ 0xffffffffUL);
+}
+
+/* the rows of a PNG, top first, each filtered by the one above it */
+static size_t film_rows(const struct film_job *job) {
+  int w = film.width, h = film.height, x, y;
+  unsigned char *raw = job->raw;
+
+  for (y = h - 1; y >= 0; y--) {
+    const unsigned char *p = job->pixels + (size_t)4 * w * y;
+    const unsigned char *above = y < h - 1 ? p + 4 * w : NULL;
+
+    *raw++ = 2; /* up */
+    for (x = 0; x < w; x++, p += 4)
+      if (above) {
+        *raw++ = p[0] - above[4 * x];
+        *raw++ = p[1] - above[4 * x + 1];
+        *raw++ = p[2] - above[4 * x + 2];
+      } else {
+        *raw++ = p[0];
+        *raw++ = p[1];
+        *raw++ = p[2];
+      }
+  }
+  return raw - job->raw;
+}
+
+/* A zlib stream of the rows.  Without zlib they are stored, which takes
+ * more room but nearly no time. */
+static size_t film_deflate(unsigned char *out, const unsigned char *raw,
+                           size_t size) {
+#ifdef HAVE_ZLIB
+  uLongf length = compressBound(size);
+
+  return compress2(out, &length, raw, size, Z_BEST_SPEED) == Z_OK ? length
+                                                                   : 0;
+#else
+  unsigned long a = 1, b = 0;
+  unsigned char *start = out;
+  size_t i, n;
+
+  *out++ = 0x78;
+  *out++ = 0x01;
+  do {
+    n = MIN(size, 65535);
+    *out++ = n == size;
+    *out++ = n & 0xff;
+    *out++ = n >> 8;
+    *out++ = ~n & 0xff;
+    *out++ = (~n >> 8) & 0xff;
+    memcpy(out, raw, n);
+    for (i = 0; i < n; i++) {
+      a = (a + raw[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+    out += n;
+    raw += n;
+    size -= n;
+  } while (size);
+  out = film_be32(out, (b << 16) | a);
+  return out - start;
+#endif
+}
+
+static void film_png(struct film_job *job) {
+  static const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                             '\r', '\n', 0x1a, '\n'};
+  unsigned char *out = job->out, *header = out + 8, *data;
+  size_t size;
+
+  memcpy(out, signature, sizeof(signature));
+  data = film_be32(film_be32(header + 8, film.width), film.height);
+  data[0] = 8; /* bits a channel */
+  data[1] = 2; /* RGB */
+  data[2] = data[3] = data[4] = 0;
+  data = film_chunk(header, "IHDR", 13);
+  size = film_deflate(data + 8, job->raw, film_rows(job));
+  data = film_chunk(data, "IDAT", size);
+  job->size = film_chunk(data, "IEND", 0) - out;
+}
+
+static void film_ppm(struct film_job *job) {
+  int w = film.width, h = film.height, x, y;
+  unsigned char *out = job->out;
+
+  out += sprintf((char *)out, "P6\n%d %d\n255\n", w, h);
+  for (y = h - 1; y >= 0; y--) {
+    const unsigned char *p = job->pixels + (size_t)4 * w * y;
+
+    for (x = 0; x < w; x++, p += 4) {
+      *out++ = p[0];
+      *out++ = p[1];
+      *out++ = p[2];
+    }
+  }
+  job->size = out - job->out;
+}
+
+/* a Y4M frame: full range BT.601 luma, and chroma for each two by two.
+ * Pure blue or red would come to 256, so the chroma is kept to a byte. */
+static void film_y4m(struct film_job *job) {
+  int w = film.width, h = film.height, cw = (w + 1) / 2, ch = (h + 1) / 2;
+  unsigned char *y = job->out + 6, *u = y + (size_t)w * h;
+  unsigned char *v = u + (size_t)cw * ch;
+  int row, x, i, j;
+
+  memcpy(job->out, "FRAME\n", 6);
+  for (row = h - 1; row >= 0; row--) {
+    const unsigned char *p = job->pixels + (size_t)4 * w * row;
+
+    for (x = 0; x < w; x++, p += 4)
+      *y++ = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+  }
+  for (row = 0; row < ch; row++)
+    for (x = 0; x < cw; x++) {
+      int r = 0, g = 0, b = 0, n = 0;
+
+      for (j = 2 * row; j < MIN(2 * row + 2, h); j++)
+        for (i = 2 * x; i < MIN(2 * x + 2, w); i++) {
+          const unsigned char *p =
+              job->pixels + 4 * ((size_t)w * (h - 1 - j) + i);
+
+          r += p[0];
+          g += p[1];
+          b += p[2];
+          n++;
+        }
+      *u++ = MIN(((-43 * r - 85 * g + 128 * b) / n + 32768 + 128) >> 8, 255);
+      *v++ = MIN(((128 * r - 107 * g - 21 * b) / n + 32768 + 128) >> 8, 255);
+    }
+  job->size = v - job->out;
+}
+
+static void film_encode(struct film_job *job) {
+  switch (film.kind) {
+    case FILM_PPM:
+      film_ppm(job);
+      break;
+    case FILM_Y4M:
+      film_y4m(job);
+      break;
+    case FILM_PNG:
+      film_png(job);
+      break;
+    default:
+      mesh_encode(job);
+      break;
+  }
+}
+
+#ifdef HAVE_PTHREAD
+/* an encoder: take the oldest frame waiting, encode it, and say so */
+static void *film_worker(void *unused ATTRIBUTE_UNUSED) {
+  struct film_job *job;
+  int i;
+
+  pthread_mutex_lock(&film.lock);
+  for (;;) {
+    for (job = NULL, i = 0; i < FILM_JOBS; i++)
+      if (film.job[i].state == FILM_READY &&
+          (!job || film.job[i].frame < job->frame))
+        job = &film.job[i];
+    if (!job) {
+      if (film.stop) break;
+      pthread_cond_wait(&film.go, &film.lock);
+      continue;
+    }
+    job->state = FILM_BUSY;
+    pthread_mutex_unlock(&film.lock);
+    film_encode(job);
+    pthread_mutex_lock(&film.lock);
+    job->state = FILM_DONE;
+    pthread_cond_broadcast(&film.done);
+  }
+  pthread_mutex_unlock(&film.lock);
+  return NULL;
+}
+#endif
+
+/* Write out the frames that are done, in order.  If wait, wait for the
+ * next one to be done first. */
+static void film_write(int wait) {
+  for (;;) {
+    struct film_job *job = &film.job[film.written % FILM_JOBS];
+    int state;
+
+    film_lock();
+#ifdef HAVE_PTHREAD
+    while (wait && (job->state == FILM_READY || job->state == FILM_BUSY))
+      pthread_cond_wait(&film.done, &film.lock);
+#else
+    /* frames are encoded as they come, so there's never any waiting */
+    (void)wait;
+#endif
+    state = job->state;
+    film_unlock();
+    if (state != FILM_DONE) return;
+
+    if (film.path) {
+      FILE *f;
+
+      sprintf(film.name, film.path, (int)film.written + 1);
+      if ((f = fopen(film.name, "wb")) == NULL ||
+          fwrite(job->out, 1, job->size, f) != job->size || fclose(f)) {
+        fprintf(stderr, "glsnake: can't write %s: %s\n", film.name,
+                strerror(errno));
+        exit(1);
+      }
+    } else {
+      fwrite(job->out, 1, job->size, stdout);
+    }
+    film_lock();
+    job->state = FILM_FREE;
+    film_unlock();
+    film.written++;
+    wait = 0;
+  }
+}
+
+/* the job for frame n, once whatever was in it has been written */
+static struct film_job *film_slot(long n) {
+  struct film_job *job = &film.job[n % FILM_JOBS];
+
+  while (film.written <= n - FILM_JOBS) film_write(1);
+  job->frame = n;
+  return job;
+}
+
+/* hand a frame over to be encoded */
+static void film_submit(struct film_job *job) {
+#ifdef HAVE_PTHREAD
+  if (film.threads) {
+    pthread_mutex_lock(&film.lock);
+    job->state = FILM_READY;
+    pthread_cond_signal(&film.go);
+    pthread_mutex_unlock(&film.lock);
+    film_write(0);
+    return;
+  }
+#endif
+  film_encode(job);
+  job->state = FILM_DONE;
+  film_write(0);
+}
+
+/* Set up the jobs, with room for pixels and raw PNG rows if they are
+ * wanted, and film.room for what they encode to, and start the
+ * encoders. */
+static void film_jobs(size_t pixels, size_t raw) {
+  unsigned long c;
+  int i, k;
+
+  for (i = 0; i < FILM_JOBS; i++) {
+    struct film_job *job = &film.job[i];
+
+    job->pixels = pixels ? malloc(pixels) : NULL;
+    job->raw = raw ? malloc(raw) : NULL;
+    job->out = malloc(film.room);
+    job->mesh = film.kind >= FILM_STL ? malloc(sizeof(struct mesh)) : NULL;
+    if ((pixels && !job->pixels) || (raw && !job->raw) || !job->out ||
+        (film.kind >= FILM_STL && !job->mesh)) {
+      fprintf(stderr, "glsnake: out of memory\n");
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < 256; i++) {
+    for (c = i, k = 0; k < 8; k++)
+      c = c & 1 ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+    film.crc[i] = c;
+  }
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init(&film.lock, NULL);
+  pthread_cond_init(&film.go, NULL);
+  pthread_cond_init(&film.done, NULL);
+  while (film.threads < MIN(sysconf(_SC_NPROCESSORS_ONLN), FILM_THREADS) &&
+         !pthread_create(&film.thread[film.threads], NULL, film_worker, NULL))
+    film.threads++;
+#endif
+}
+
+/* write out what is left, and stop the encoders */
+static void film_finish(void) {
+  while (film.written < film.frames) film_write(1);
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&film.lock);
+  film.stop = 1;
+  pthread_cond_broadcast(&film.go);
+  pthread_mutex_unlock(&film.lock);
+  while (film.threads) pthread_join(film.thread[--film.threads], NULL);
+#endif
+  fflush(stdout);
+}
+
+#ifdef GL_VERSION_3_0
+/* copy frame n out of its pixel buffer, to be encoded */
+static void film_collect(long n) {
+  struct film_job *job = film_slot(n);
+  const void *pixels;
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, film.pbo[n % FILM_PBOS]);
+  pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+  if (pixels) {
+    memcpy(job->pixels, pixels, (size_t)4 * film.width * film.height);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  film_submit(job);
+}
+
+/* start reading frame n back, and pick up the one FILM_PBOS - 1 before
+ * it.  Without pixel buffers, read it back there and then. */
+static void film_read(long n) {
+  if (!film.pbos) {
+    struct film_job *job = film_slot(n);
+
+    glReadPixels(0, 0, film.width, film.height, GL_RGBA, GL_UNSIGNED_BYTE,
+                 job->pixels);
+    film_submit(job);
+    return;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, film.pbo[n % FILM_PBOS]);
+  glReadPixels(0, 0, film.width, film.height, GL_RGBA, GL_UNSIGNED_BYTE,
+               NULL);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  if (n >= FILM_PBOS - 1) film_collect(n - (FILM_PBOS - 1));
+}
+
+/* Give up if a frame w by h, what it is, is bigger than the GL can draw
+ * into.  The sizes are long long, so that a product of two ints that
+ * would have wrapped is still caught.  A GL without framebuffer objects
+ * doesn't say, and film_start turns it down anyway. */
+static void film_fits(long long w, long long h, const char *what) {
+  GLint most = 0;
+
+  glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &most);
+  if (most > 0 && (w > most || h > most)) {
+    fprintf(stderr, "glsnake: %s of %lldx%lld is over the %dx%d this GL "
+            "can draw\n", what, w, h, most, most);
+    exit(1);
+  }
+}
+
+/* set up the framebuffer, the pixel buffers, the jobs and the encoders;
+ * returns 0 if it can't be done */
+static int film_start(void) {
+  const char *version = (const char *)glGetString(GL_VERSION);
+  const char *ext = (const char *)glGetString(GL_EXTENSIONS);
+  size_t pixels = (size_t)4 * film.width * film.height;
+  size_t raw = film.height * (1 + (size_t)3 * film.width);
+  int major = 0, minor = 0, i;
+
+  if (!version || sscanf(version, "%d.%d", &major, &minor) != 2) return 0;
+  if (major < 3 && !(ext && strstr(ext, "GL_ARB_framebuffer_object")))
+    return 0;
+
+  glGenRenderbuffers(1, &film.colour);
+  glBindRenderbuffer(GL_RENDERBUFFER, film.colour);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, film.width, film.height);
+  glGenRenderbuffers(1, &film.depth);
+  glBindRenderbuffer(GL_RENDERBUFFER, film.depth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, film.width,
+                        film.height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  glGenFramebuffers(1, &film.framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, film.framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, film.colour);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER, film.depth);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    return 0;
+
+  /* pixel buffers came in with GL 2.1, before framebuffers */
+  film.pbos = major > 2 || (major == 2 && minor >= 1) ||
+              (ext && strstr(ext, "GL_ARB_pixel_buffer_object"));
+  if (film.pbos) {
+    glGenBuffers(FILM_PBOS, film.pbo);
+    for (i = 0; i < FILM_PBOS; i++) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, film.pbo[i]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, pixels, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  /* room for a whole frame of the format */
+  switch (film.kind) {
+    case FILM_PPM:
+      film.room = 32 + (size_t)3 * film.width * film.height;
+      break;
+    case FILM_Y4M:
+      film.room = 6 + (size_t)film.width * film.height +
+                  (size_t)2 * ((film.width + 1) / 2) * ((film.height + 1) / 2);
+      break;
+    case FILM_PNG:
+#ifdef HAVE_ZLIB
+      film.room = 8 + 25 + 12 + compressBound(raw) + 12;
+#else
+      film.room = 8 + 25 + 12 + 6 + raw + 5 * (raw / 65535 + 1) + 12;
+#endif
+      break;
+  }
+  film_jobs(pixels, film.kind == FILM_PNG ? raw : 0);
+  glsnake_reshape(film.width, film.height);
+  return 1;
+}
+
+#endif
+
+static void film_run(void) {
+#ifdef GL_VERSION_3_0
+  long long frame = 1000000000LL / (maxfps > 0 ? maxfps : VIRTUAL_FPS);
+  long long began = real_nsec();
+  long n;
+
+  film_fits(film.width, film.height, "-export-size");
+  if (!film_start()) {
+    fprintf(stderr, "glsnake: can't export without framebuffer objects\n");
+    exit(1);
+  }
+  if (film.kind == FILM_Y4M)
+    printf("YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XCOLORRANGE=FULL\n",
+           film.width, film.height, maxfps > 0 ? maxfps : VIRTUAL_FPS, 1);
+
+  for (n = 0; n < film.frames; n++) {
+    sleep_until_nsec(virtual_clock + frame);
+    sim_tick();
+    glBindFramebuffer(GL_FRAMEBUFFER, film.framebuffer);
+    glsnake_display();
+    film_read(n);
+  }
+  for (n = MAX(film.frames - (FILM_PBOS - 1), 0); film.pbos && n < film.frames;
+       n++)
+    film_collect(n);
+  film_finish();
+
+  if (ferror(stdout))
+    fprintf(stderr, "glsnake: couldn't write all the frames\n");
+  else
+    fprintf(stderr, "glsnake: exported %d %dx%d frames in %.2f s, %.1f a "
+            "second\n", film.frames, film.width, film.height,
+            (real_nsec() - began) / 1e9,
+            film.frames * 1e9 / MAX(real_nsec() - began, 1));
+#else
+  fprintf(stderr, "glsnake: built without framebuffer objects to export\n");
+  exit(1);
+#endif
+}
+
+/* Is path a name with just one number in it, as printf's %d, and a format
+ * to go by?  Returns the kind of file, or -1 if not. */
+static int film_pattern(const char *path) {
+  static const char *const kinds[] = {".ppm", ".y4m", ".png",
+                                      ".stl", ".obj", ".ply"};
+  const char *p, *dot = strrchr(path, '.');
+  int numbers = 0, width, kind;
+
+  for (p = path; *p; p++) {
+    if (*p != '%') continue;
+    if (*++p == '%') continue;
+    for (width = 0; *p == '0' || isdigit((unsigned char)*p); p++) width++;
+    if (*p != 'd' || width > 2) return -1;
+    numbers++;
+  }
+  if (numbers != 1 || !dot) return -1;
+  for (kind = FILM_PPM; kind <= FILM_PLY; kind++)
+    if (!strcmp(dot, kinds[kind])) return kind;
+  return -1;
+}
+
+/*
+ * The models file.  Each line is a name, a colon, and a letter for each
+ * joint, Z, L, P or R, as the d key prints them; blank lines and lines
+ * starting with # are skipped.
+ */
+#define MODEL_LINE 1024
+
+static void model_load(const char *path) {
+  struct model_s *loaded = NULL, *grown;
+  size_t count = 0, room = 0;
+  char line[MODEL_LINE], *p, *colon, *end, *name;
+  int number = 0, i;
+  FILE *f;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "glsnake: can't open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    number++;
+    for (p = line; isspace((unsigned char)*p); p++)
+      ;
+    if (!*p || *p == '#') continue;
+
+    if (count == room) {
+      room = room ? 2 * room : 256;
+      if ((grown = realloc(loaded, room * sizeof(*loaded))) == NULL) {
+        fprintf(stderr, "glsnake: out of memory for %lu models\n",
+                (unsigned long)room);
+        exit(1);
+      }
+      loaded = grown;
+    }
+
+    /* the name runs up to the last colon, less any space around it */
+    if ((colon = strrchr(p, ':')) == NULL) goto bad;
+    for (end = colon; end > p && isspace((unsigned char)end[-1]); end--)
+      ;
+    if ((name = malloc(end - p + 1)) == NULL) {
+      fprintf(stderr, "glsnake: out of memory\n");
+      exit(1);
+    }
+    memcpy(name, p, end - p);
+    name[end - p] = '\0';
+    loaded[count].name = name;
+
+    for (i = 0, p = colon + 1; *p; p++) {
+      unsigned char joint;
+
+      if (isspace((unsigned char)*p)) continue;
+      switch (toupper((unsigned char)*p)) {
+        case 'Z':
+          joint = ZERO;
+          break;
+        case 'L':
+          joint = LEFT;
+          break;
+        case 'P':
+          joint = PIN;
+          break;
+        case 'R':
+          joint = RIGHT;
+          break;
+        default:
+          goto bad;
+      }
+      if (i == NODE_COUNT) goto bad;
+      loaded[count].shape.node[i++] = joint;
+    }
+    if (i != NODE_COUNT) goto bad;
+    count++;
+  }
+  if (ferror(f) || !count) goto bad;
+  fclose(f);
+
+  model = loaded;
+  models = count;
+  return;
+
+bad:
+  if (ferror(f))
+    fprintf(stderr, "glsnake: can't read %s: %s\n", path, strerror(errno));
+  else if (!count && feof(f))
+    fprintf(stderr, "glsnake: there are no models in %s\n", path);
+  else
+    fprintf(stderr,
+            "glsnake: %s:%d: a model is a name, a colon, and %d joints "
+            "of Z, L, P or R\n",
+            path, number, NODE_COUNT);
+  exit(1);
+}
+
+/*
+ * Contact sheets.  -sheets draws every model in the catalogue, still and
+ * in its own colours, on sheets of -sheet-grid thumbnails, each
+ * -thumb-size with the model's name under it.  All of a sheet is drawn
+ * into one framebuffer, a viewport a model, with nothing of GL's set up
+ * again in between but the projection, and then read back and encoded
+ * like exported frames, to files numbered from one.
+ */
+#define SHEET_YSPIN 35.0 /* the angles each model is seen at */
+#define SHEET_XSPIN 25.0
+#define SHEET_MARGIN 1.08 /* room around a model in its thumbnail */
+
+#ifdef GL_VERSION_3_0
+/* draw model m in the thumbnail whose bottom left corner is at x, y */
+static void sheet_model(const struct model_s *m, int x, int y) {
+  float node_mat[NODE_COUNT][16], com[3], centre[NODE_COUNT][3], box[2][3];
+  float radius, half, aspect, distance;
+  int angle[NODE_COUNT], label = atlas.texture ? atlas.cell : 16;
+  struct snake_metrics metrics;
+  int i, odd;
+  const GLfloat *c;
+
+  for (i = 0; i < NODE_COUNT; i++) angle[i] = m->shape.node[i] << ANGLE_SHIFT;
+  snake_kinematics(angle, explode, node_mat, com);
+  snake_extent(node_mat, com, centre, box, &radius);
+
+  /* back off until the model's bounding sphere fits the narrower way */
+  glViewport(x, y + label, sheet.width, sheet.height - label);
+  aspect = (float)sheet.width / (sheet.height - label);
+  half = atan(tan(zoom * M_PI / 360.0) * MIN(aspect, 1.0));
+  distance = SHEET_MARGIN * radius / sin(half);
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  gluPerspective(zoom, aspect, MAX(distance - radius - 1.0, 0.05),
+                 distance + radius + 1.0);
+  gluLookAt(0.0, 0.0, distance, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  glRotatef(SHEET_XSPIN, 1.0, 0.0, 0.0);
+  glRotatef(SHEET_YSPIN, 0.0, 1.0, 0.0);
+  glTranslatef(-com[0], -com[1], -com[2]);
+
+  /* the nodes of each colour together, to change material just twice */
+  calc_snake_metrics_shape(&m->shape, &metrics);
+  for (odd = 0; odd < 2; odd++) {
+    c = colour[metrics_colour(&metrics)][odd ? 0 : 1];
+    if (wireframe) {
+      glColor4fv(c);
+    } else {
+      gls_material(GL_AMBIENT, c);
+      gls_material(GL_DIFFUSE, c);
+    }
+    for (i = odd; i < NODE_COUNT; i += 2) {
+      glPushMatrix();
+      glMultMatrixf(node_mat[i]);
+      gls_call_list(node_list(LOD_FULL));
+      glPopMatrix();
+    }
+  }
+}
+
+/* the name of model m, cut short to fit, under the thumbnail at x, y */
+static void sheet_name(const struct model_s *m, int x, int y) {
+  char name[64];
+  size_t n;
+
+  strncpy(name, m->name, sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  if (!atlas.texture) {
+    glRasterPos2i(x + 3, y + 4);
+    for (n = 0; name[n] && n < (size_t)sheet.width / 8; n++)
+      glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, name[n]);
+    return;
+  }
+  for (n = strlen(name); n && text_width(name) > sheet.width - 6; n--)
+    name[n - 1] = '\0';
+  if (atlas.quads + n > TEXT_QUADS) text_flush();
+  text_string(x + (sheet.width - text_width(name)) / 2, y + atlas.base,
+              name);
+}
+
+/* draw sheet n, which starts with model first */
+static void sheet_draw(size_t first) {
+  size_t per = sheet.columns * sheet.rows, i;
+  int was[GLS_CAPS], top = sheet.rows * sheet.height;
+
+  glViewport(0, 0, film.width, film.height);
+  glClear((GLbitfield)GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  for (i = 0; i < per && first + i < models; i++)
+    sheet_model(&model[first + i], i % sheet.columns * sheet.width,
+                top - (int)(i / sheet.columns + 1) * sheet.height);
+
+  /* then all the names, as draw_title does */
+  memcpy(was, gls.cap, sizeof(was));
+  gls_enable(GLS_LIGHTING, 0);
+  gls_enable(GLS_DEPTH_TEST, 0);
+  gls_enable(GLS_BLEND, 0);
+  glViewport(0, 0, film.width, film.height);
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  gluOrtho2D(0.0, (GLdouble)film.width, 0.0, (GLdouble)film.height);
+  glColor4f(1.0, 1.0, 1.0, 1.0);
+  for (i = 0; i < per && first + i < models; i++)
+    sheet_name(&model[first + i], i % sheet.columns * sheet.width,
+               top - (int)(i / sheet.columns + 1) * sheet.height);
+  text_flush();
+  gls_enable(GLS_LIGHTING, was[GLS_LIGHTING]);
+  gls_enable(GLS_DEPTH_TEST, was[GLS_DEPTH_TEST]);
+  gls_enable(GLS_BLEND, was[GLS_BLEND]);
+}
+#endif
+
+static void sheet_run(void) {
+#ifdef GL_VERSION_3_0
+  long long began = real_nsec();
+  size_t per = sheet.columns * sheet.rows;
+  long n;
+
+  film.path = sheet.path;
+  film_fits((long long)sheet.columns * sheet.width,
+            (long long)sheet.rows * sheet.height, "a contact sheet");
+  film.width = sheet.columns * sheet.width;
+  film.height = sheet.rows * sheet.height;
+  film.frames = (models + per - 1) / per;
+  if ((film.name = malloc(strlen(film.path) + 100)) == NULL) {
+    fprintf(stderr, "glsnake: out of memory\n");
+    exit(1);
+  }
+  if (!film_start()) {
+    fprintf(stderr, "glsnake: can't draw contact sheets without "
+            "framebuffer objects\n");
+    exit(1);
+  }
+  text_atlas();
+
+  for (n = 0; n < film.frames; n++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, film.framebuffer);
+    sheet_draw(n * per);
+    film_read(n);
+  }
+  for (n = MAX(film.frames - (FILM_PBOS - 1), 0); film.pbos && n < film.frames;
+       n++)
+    film_collect(n);
+  film_finish();
+
+  fprintf(stderr, "glsnake: drew %lu models on %d %dx%d sheets in %.2f s\n",
+          (unsigned long)models, film.frames, film.width, film.height,
+          (real_nsec() - began) / 1e9);
+#else
+  fprintf(stderr, "glsnake: built without framebuffer objects to draw "
+          "contact sheets\n");
+  exit(1);
+#endif
+}
+
+/*
+ * Meshes.  -meshes writes each model in the catalogue, posed with no gap
+ * between the nodes, as a binary STL, an OBJ or a binary PLY file, or
+ * all of them as OBJ objects on stdout, for 3D printing.  Each node is
+ * the bevelled prism it is drawn with, a closed surface of its own.
+ * With -mesh-merge the bevels are left off, so that prisms that touch
+ * meet exactly, and the faces where they meet are taken out, joining
+ * them up into one surface.  Models are meshed on the encoders, and
+ * written out in order as they are done.
+ */
+
+/* the vertex at p, which is the same as one from index from on if it is
+ * within a hair of it */
+static int mesh_vertex(struct mesh *m, const float *p, int from) {
+  int i;
+
+  for (i = from; i < m->vertices; i++)
+    if (fabs(m->vertex[i][0] - p[0]) < 1e-4 &&
+        fabs(m->vertex[i][1] - p[1]) < 1e-4 &&
+        fabs(m->vertex[i][2] - p[2]) < 1e-4)
+      return i;
+  memcpy(m->vertex[i], p, sizeof(m->vertex[i]));
+  return m->vertices++;
+}
+
+/* add the convex polygon with n corners in a node's own space, placed by
+ * the node's transform t */
+static void mesh_polygon(struct mesh *m, const float t[16], float corner[][3],
+                         int n, int from) {
+  int index[6], i;
+  float p[3];
+
+  for (i = 0; i < n; i++) {
+    p[0] = t[0] * corner[i][0] + t[4] * corner[i][1] + t[8] * corner[i][2] +
+           t[12];
+    p[1] = t[1] * corner[i][0] + t[5] * corner[i][1] + t[9] * corner[i][2] +
+           t[13];
+    p[2] = t[2] * corner[i][0] + t[6] * corner[i][1] + t[10] * corner[i][2] +
+           t[14];
+    index[i] = mesh_vertex(m, p, from);
+  }
+  for (i = 1; i < n - 1; i++) {
+    m->triangle[m->triangles][0] = index[0];
+    m->triangle[m->triangles][1] = index[i];
+    m->triangle[m->triangles][2] = index[i + 1];
+    m->triangles++;
+  }
+}
+
+static float mesh_distance2(const float *a, const float *b) {
+  return (a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) +
+         (a[2] - b[2]) * (a[2] - b[2]);
+}
+
+static void mesh_midpoint(float *out, const float *a, const float *b) {
+  out[0] = 0.5 * (a[0] + b[0]);
+  out[1] = 0.5 * (a[1] + b[1]);
+  out[2] = 0.5 * (a[2] + b[2]);
+}
+
+/* add the rectangle p as the four triangles from its middle to its sides,
+ * which come out the same whichever corner it starts at */
+static void mesh_fan(struct mesh *m, const float t[16], float p[4][3]) {
+  float tri[3][3];
+  int i;
+
+  mesh_midpoint(tri[2], p[0], p[2]);
+  for (i = 0; i < 4; i++) {
+    memcpy(tri[0], p[i], sizeof(tri[0]));
+    memcpy(tri[1], p[(i + 1) % 4], sizeof(tri[1]));
+    mesh_polygon(m, t, tri, 3, 0);
+  }
+}
+
+/* Add one of the faces of a sharp prism, which has whole numbers for
+ * corners.  Where two prisms touch, they meet on a side of a cube, or
+ * across its diagonal, so each side of a cube is split into the four
+ * triangles from its middle, and the diagonal face is cut where it
+ * crosses those middles.  Then two faces that meet are the same
+ * triangles, and no corner lies along an edge. */
+static void mesh_sharp(struct mesh *m, const float t[16], float p[][3],
+                       int n) {
+  float tri[3][3], quad[4][3];
+  int i, k;
+
+  if (n == 3) {
+    /* an end: the two halves either side of the long edge's middle */
+    for (i = 0; mesh_distance2(p[i], p[(i + 1) % 3]) < 1.5; i++)
+      ;
+    mesh_midpoint(tri[1], p[i], p[(i + 1) % 3]);
+    memcpy(tri[0], p[i], sizeof(tri[0]));
+    memcpy(tri[2], p[(i + 2) % 3], sizeof(tri[2]));
+    mesh_polygon(m, t, tri, 3, 0);
+    memcpy(tri[0], tri[1], sizeof(tri[0]));
+    memcpy(tri[1], p[(i + 1) % 3], sizeof(tri[1]));
+    mesh_polygon(m, t, tri, 3, 0);
+  } else if (mesh_distance2(p[0], p[1]) < 1.5 &&
+             mesh_distance2(p[1], p[2]) < 1.5) {
+    /* a square */
+    mesh_fan(m, t, p);
+  } else {
+    /* the diagonal: two halves, cut across the middles of the long edges,
+     * each a fan so that the prism on its other side splits it the same
+     * way */
+    k = mesh_distance2(p[0], p[1]) < 1.5;
+    for (i = 0; i < 2; i++) {
+      memcpy(quad[0], p[(k + 2 * i) % 4], sizeof(quad[0]));
+      mesh_midpoint(quad[1], p[(k + 2 * i) % 4], p[(k + 2 * i + 1) % 4]);
+      mesh_midpoint(quad[2], p[(k + 2 * i + 2) % 4], p[(k + 2 * i + 3) % 4]);
+      memcpy(quad[3], p[(k + 2 * i + 3) % 4], sizeof(quad[3]));
+      mesh_fan(m, t, quad);
+    }
+  }
+}
+
+/* order triangles by their corners, whichever way round they go */
+static void mesh_key(const int *tri, int *key) {
+  int k;
+
+  memcpy(key, tri, 3 * sizeof(int));
+  if (key[0] > key[1]) k = key[0], key[0] = key[1], key[1] = k;
+  if (key[1] > key[2]) k = key[1], key[1] = key[2], key[2] = k;
+  if (key[0] > key[1]) k = key[0], key[0] = key[1], key[1] = k;
+}
+
+static int mesh_compare(const void *a, const void *b) {
+  int x[3], y[3], k;
+
+  mesh_key(a, x);
+  mesh_key(b, y);
+  for (k = 0; k < 3; k++)
+    if (x[k] != y[k]) return x[k] < y[k] ? -1 : 1;
+  return 0;
+}
+
+/* take out the triangles that are there twice, facing each other, and
+ * the vertices that are left out of the rest */
+static void mesh_join(struct mesh *m) {
+  int used[MESH_VERTICES], i, j, n;
+
+  qsort(m->triangle, m->triangles, sizeof(m->triangle[0]), mesh_compare);
+  for (i = n = 0; i < m->triangles; i = j) {
+    for (j = i + 1;
+         j < m->triangles && !mesh_compare(m->triangle[i], m->triangle[j]);
+         j++)
+      ;
+    if (j == i + 1) memmove(m->triangle[n++], m->triangle[i],
+                            sizeof(m->triangle[0]));
+  }
+  m->triangles = n;
+
+  memset(used, 0, sizeof(used));
+  for (i = 0; i < m->triangles; i++)
+    for (j = 0; j < 3; j++) used[m->triangle[i][j]] = 1;
+  for (i = n = 0; i < m->vertices; i++)
+    if (used[i]) {
+      memmove(m->vertex[n], m->vertex[i], sizeof(m->vertex[0]));
+      used[i] = n++;
+    }
+  m->vertices = n;
+  for (i = 0; i < m->triangles; i++)
+    for (j = 0; j < 3; j++) m->triangle[i][j] = used[m->triangle[i][j]];
+}
 
-  glFlush();
-#ifdef HAVE_GLUT
-  glutSwapBuffers();
-#else
-  glXSwapBuffers(dpy, window);
-#endif
+static int mesh_find(int *parent, int i) {
+  while (parent[i] != i) i = parent[i] = parent[parent[i]];
+  return i;
+}
+
+/* the part of the vertex w, seen from u, square to the unit axis a */
+static void mesh_across(float *out, const struct mesh *m, int u, int w,
+                        const float *a) {
+  float along = 0.0;
+  int k;
+
+  for (k = 0; k < 3; k++) {
+    out[k] = m->vertex[w][k] - m->vertex[u][k];
+    along += out[k] * a[k];
+  }
+  for (k = 0; k < 3; k++) out[k] -= along * a[k];
+}
+
+/* Where prisms touch only along an edge, four faces meet on it.  Each
+ * face's edge is paired with a face going back along it -- the next one
+ * round on the inside of the solid, or the one after that where the
+ * corner was marked far -- and then each fan of faces about a vertex that
+ * is joined up that way gets a copy of the vertex of its own. */
+static void mesh_unpinch(struct mesh *m, const char *far) {
+  int parent[3 * MESH_TRIANGLES], copy[3 * MESH_TRIANGLES];
+  int claimed[MESH_VERTICES];
+  float a[3], wf[3], wg[3], length, angle, best;
+  int f, g, j, k, c, u, v, twin, n = m->vertices;
+
+  for (c = 0; c < 3 * m->triangles; c++) {
+    parent[c] = c;
+    copy[c] = -1;
+  }
+  for (f = 0; f < m->triangles; f++)
+    for (j = 0; j < 3; j++) {
+      u = m->triangle[f][j];
+      v = m->triangle[f][(j + 1) % 3];
+      for (k = 0, length = 0.0; k < 3; k++) {
+        a[k] = m->vertex[v][k] - m->vertex[u][k];
+        length += a[k] * a[k];
+      }
+      for (k = 0, length = sqrt(length); k < 3; k++) a[k] /= length;
+      mesh_across(wf, m, u, m->triangle[f][(j + 2) % 3], a);
+
+      /* the faces going back along the edge, by how far they are turned
+       * from this one away from its outside */
+      twin = -1;
+      best = far[3 * f + j] ? -1.0 : 7.0;
+      for (g = 0; g < m->triangles; g++)
+        for (k = 0; k < 3; k++) {
+          if (m->triangle[g][k] != v || m->triangle[g][(k + 1) % 3] != u)
+            continue;
+          mesh_across(wg, m, u, m->triangle[g][(k + 2) % 3], a);
+          angle = atan2(-(a[0] * (wf[1] * wg[2] - wf[2] * wg[1]) +
+                          a[1] * (wf[2] * wg[0] - wf[0] * wg[2]) +
+                          a[2] * (wf[0] * wg[1] - wf[1] * wg[0])),
+                        wf[0] * wg[0] + wf[1] * wg[1] + wf[2] * wg[2]);
+          if (angle <= 0.0) angle += 2 * M_PI;
+          if (far[3 * f + j] ? angle > best : angle < best) {
+            best = angle;
+            twin = 3 * g + k;
+          }
+        }
+      if (twin < 0) continue;
+      /* join up the corners at each end of the edge */
+      parent[mesh_find(parent, 3 * f + j)] =
+          mesh_find(parent, twin - twin % 3 + (twin % 3 + 1) % 3);
+      parent[mesh_find(parent, 3 * f + (j + 1) % 3)] =
+          mesh_find(parent, twin);
+    }
+
+  memset(claimed, 0, sizeof(claimed));
+  for (c = 0; c < 3 * m->triangles; c++) {
+    int root = mesh_find(parent, c);
+
+    if (copy[root] < 0) {
+      u = m->triangle[c / 3][c % 3];
+      if (!claimed[u]) {
+        claimed[u] = 1;
+        copy[root] = u;
+      } else {
+        /* sharing the vertex would leave the pinch in */
+        if (n == MESH_VERTICES) {
+          fprintf(stderr, "glsnake: a joined mesh needs more than %d "
+                  "vertices\n", MESH_VERTICES);
+          exit(1);
+        }
+        memcpy(m->vertex[n], m->vertex[u], sizeof(m->vertex[n]));
+        copy[root] = n++;
+      }
+    }
+    m->triangle[c / 3][c % 3] = copy[root];
+  }
+  m->vertices = n;
+}
+
+/* mark the corners whose edge some other face also goes along, the same
+ * way; returns how many there were */
+static int mesh_shared(const struct mesh *m, char *far) {
+  int f, g, j, k, shared = 0;
+
+  memset(far, 0, 3 * MESH_TRIANGLES);
+  for (f = 0; f < m->triangles; f++)
+    for (j = 0; j < 3; j++)
+      for (g = 0; g < m->triangles; g++)
+        for (k = 0; k < 3; k++)
+          if (g != f && m->triangle[g][k] == m->triangle[f][j] &&
+              m->triangle[g][(k + 1) % 3] == m->triangle[f][(j + 1) % 3]) {
+            far[3 * f + j] = 1;
+            shared++;
+          }
+  return shared;
+}
+
+/* Give every edge just two faces going opposite ways.  Pairing each face
+ * with its neighbour inside the solid parts the prisms, unless they also
+ * meet round one end of the edge; the fan about that end then stays in
+ * one piece, and pairing across the edge instead is what parts it.  This
+ * runs on the encoders, so what it keeps is its own. */
+static void mesh_split(struct mesh *m) {
+  struct mesh *joined = malloc(sizeof(*joined));
+  char far[3 * MESH_TRIANGLES];
+
+  if (!joined) {
+    fprintf(stderr, "glsnake: out of memory\n");
+    exit(1);
+  }
+  memcpy(joined, m, sizeof(*joined));
+  memset(far, 0, sizeof(far));
+  mesh_unpinch(m, far);
+  if (mesh_shared(m, far)) {
+    memcpy(m, joined, sizeof(*joined));
+    mesh_unpinch(m, far);
+  }
+  free(joined);
+}
+
+/* mesh the snake in shape, sitting on the origin */
+static void mesh_build(struct mesh *m, const struct glsnake_shape *shape,
+                       int merge) {
+  float node_mat[NODE_COUNT][16], com[3], corner[4][3], least[3];
+  int angle[NODE_COUNT], i, j, k, f, from;
+
+  for (i = 0; i < NODE_COUNT; i++) angle[i] = shape->node[i] << ANGLE_SHIFT;
+  snake_kinematics(angle, 0.0, node_mat, com);
+
+  m->vertices = m->triangles = 0;
+  for (i = 0; i < NODE_COUNT; i++) {
+    /* a node's own corners are shared, but not with other nodes unless
+     * they are being joined */
+    from = merge ? 0 : m->vertices;
+    for (f = 0; f < (int)SOLID_PRISM_FACES; f++) {
+      const unsigned char *face = solid_prism_f[f];
+
+      for (j = 0; j < face[0]; j++)
+        for (k = 0; k < 3; k++)
+          corner[j][k] = merge ? floor(solid_prism_v[face[2 + j]][k] + 0.5)
+                               : solid_prism_v[face[2 + j]][k];
+      if (!merge) {
+        mesh_polygon(m, node_mat[i], corner, face[0], from);
+        continue;
+      }
+      /* without bevels, the corner and edge faces come to nothing */
+      for (j = 1; j < face[0]; j++)
+        if (mesh_distance2(corner[j], corner[j - 1]) < 0.25) break;
+      if (j == face[0]) mesh_sharp(m, node_mat[i], corner, face[0]);
+    }
+  }
+  if (merge) {
+    mesh_join(m);
+    mesh_split(m);
+  }
+
+  for (k = 0; k < 3; k++) least[k] = FLT_MAX;
+  for (i = 0; i < m->vertices; i++)
+    for (k = 0; k < 3; k++) least[k] = MIN(least[k], m->vertex[i][k]);
+  for (i = 0; i < m->vertices; i++)
+    for (k = 0; k < 3; k++) m->vertex[i][k] -= least[k];
+}
+
+/* put a 32 bit word, or a float, out little endian, as STL and PLY want */
+static unsigned char *mesh_le32(unsigned char *out, unsigned long w) {
+  out[0] = w & 0xff;
+  out[1] = (w >> 8) & 0xff;
+  out[2] = (w >> 16) & 0xff;
+  out[3] = (w >> 24) & 0xff;
+  return out + 4;
+}
+
+static unsigned char *mesh_float(unsigned char *out, float f) {
+  unsigned int w;
+
+  memcpy(&w, &f, sizeof(w));
+  return mesh_le32(out, w);
+}
+
+static void mesh_stl(struct film_job *job, const char *name) {
+  const struct mesh *m = job->mesh;
+  unsigned char *out = job->out;
+  float a[3], b[3], n[3], length;
+  int i, k;
+
+  /* a binary STL mustn't start with "solid", as a text one does */
+  memset(out, 0, 80);
+  sprintf((char *)out, "glsnake %.70s", name);
+  out = mesh_le32(out + 80, m->triangles);
+  for (i = 0; i < m->triangles; i++) {
+    const float *p = m->vertex[m->triangle[i][0]];
+    const float *q = m->vertex[m->triangle[i][1]];
+    const float *r = m->vertex[m->triangle[i][2]];
+
+    for (k = 0; k < 3; k++) {
+      a[k] = q[k] - p[k];
+      b[k] = r[k] - p[k];
+    }
+    n[0] = a[1] * b[2] - a[2] * b[1];
+    n[1] = a[2] * b[0] - a[0] * b[2];
+    n[2] = a[0] * b[1] - a[1] * b[0];
+    length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    for (k = 0; k < 3; k++) out = mesh_float(out, n[k] / length);
+    for (k = 0; k < 3; k++) out = mesh_float(out, p[k]);
+    for (k = 0; k < 3; k++) out = mesh_float(out, q[k]);
+    for (k = 0; k < 3; k++) out = mesh_float(out, r[k]);
+    *out++ = 0;
+    *out++ = 0;
+  }
+  job->size = out - job->out;
+}
+
+/* An OBJ object.  The faces count back from the last vertex, so objects
+ * can be written one after another without knowing what went before. */
+static void mesh_obj(struct film_job *job, const char *name) {
+  const struct mesh *m = job->mesh;
+  char *out = (char *)job->out;
+  int i;
+
+  out += sprintf(out, "o %s\n", name);
+  for (i = 0; i < m->vertices; i++)
+    out += sprintf(out, "v %g %g %g\n", m->vertex[i][0], m->vertex[i][1],
+                   m->vertex[i][2]);
+  for (i = 0; i < m->triangles; i++)
+    out += sprintf(out, "f %d %d %d\n", m->triangle[i][0] - m->vertices,
+                   m->triangle[i][1] - m->vertices,
+                   m->triangle[i][2] - m->vertices);
+  job->size = (unsigned char *)out - job->out;
+}
+
+static void mesh_ply(struct film_job *job, const char *name) {
+  const struct mesh *m = job->mesh;
+  unsigned char *out = job->out;
+  int i, k;
+
+  out += sprintf((char *)out,
+                 "ply\nformat binary_little_endian 1.0\ncomment %s\n"
+                 "element vertex %d\nproperty float x\nproperty float y\n"
+                 "property float z\nelement face %d\n"
+                 "property list uchar int vertex_indices\nend_header\n",
+                 name, m->vertices, m->triangles);
+  for (i = 0; i < m->vertices; i++)
+    for (k = 0; k < 3; k++) out = mesh_float(out, m->vertex[i][k]);
+  for (i = 0; i < m->triangles; i++) {
+    *out++ = 3;
+    for (k = 0; k < 3; k++) out = mesh_le32(out, m->triangle[i][k]);
+  }
+  job->size = out - job->out;
+}
+
+/* mesh shape into the job, and encode it as a file of the given kind */
+static void mesh_shape(struct film_job *job, const struct glsnake_shape *shape,
+                       const char *name, int kind) {
+  mesh_build(job->mesh, shape, meshes.merge);
+  switch (kind) {
+    case FILM_STL:
+      mesh_stl(job, name);
+      break;
+    case FILM_OBJ:
+      mesh_obj(job, name);
+      break;
+    case FILM_PLY:
+      mesh_ply(job, name);
+      break;
+  }
+}
+
+/* mesh the model for the job's frame, and encode it */
+static void mesh_encode(struct film_job *job) {
+  const struct model_s *mdl = &model[job->frame];
+  char name[MODEL_LINE];
+  size_t i;
+
+  /* a name has to stay on its line */
+  for (i = 0; mdl->name[i] && i < sizeof(name) - 1; i++)
+    name[i] = isprint((unsigned char)mdl->name[i]) ? mdl->name[i] : '_';
+  name[i] = '\0';
+
+  mesh_shape(job, &mdl->shape, name, film.kind);
+}
+
+static void mesh_run(void) {
+  long long began = real_nsec();
+  long n;
+
+  /* the most any of the formats can come to */
+  film.room = MODEL_LINE + 400 + 64 * MESH_VERTICES + 50 * MESH_TRIANGLES;
+  film.frames = models;
+  if (strcmp(meshes.path, "-")) {
+    film.path = meshes.path;
+    if ((film.name = malloc(strlen(film.path) + 100)) == NULL) {
+      fprintf(stderr, "glsnake: out of memory\n");
+      exit(1);
+    }
+  }
+  film_jobs(0, 0);
+  for (n = 0; n < film.frames; n++) film_submit(film_slot(n));
+  film_finish();
+
+  if (ferror(stdout))
+    fprintf(stderr, "glsnake: couldn't write all the meshes\n");
+  else
+    fprintf(stderr, "glsnake: wrote %lu meshes in %.2f s\n",
+            (unsigned long)models, (real_nsec() - began) / 1e9);
+}
+
+/* Write the shape the d key has just printed to the next file named by
+ * -dump-meshes.  This is on the simulation thread, and only for one shape
+ * at a time, so it's done there and then. */
+static void mesh_dump(const struct glsnake_shape *shape) {
+  static struct mesh m;
+  static unsigned char *out;
+  static char *name;
+  struct film_job job;
+  FILE *f;
+
+  if (!out) {
+    out = malloc(MODEL_LINE + 400 + 64 * MESH_VERTICES +
+                 50 * MESH_TRIANGLES);
+    name = malloc(strlen(meshes.dump) + 100);
+    if (!out || !name) {
+      fprintf(stderr, "glsnake: out of memory\n");
+      exit(1);
+    }
+  }
+  memset(&job, 0, sizeof(job));
+  job.mesh = &m;
+  job.out = out;
+  mesh_shape(&job, shape, "noname", meshes.kind);
+
+  sprintf(name, meshes.dump, ++meshes.dumped);
+  if ((f = fopen(name, "wb")) == NULL ||
+      fwrite(job.out, 1, job.size, f) != job.size || fclose(f))
+    fprintf(stderr, "glsnake: can't write %s: %s\n", name, strerror(errno));
+  else
+    fprintf(stderr, "glsnake: wrote %s\n", name);
 }
 
-#ifdef HAVE_GLUT
 /* anything that needs to be cleaned up goes here */
 static void unmain() {
-  glutDestroyWindow(glc->window);
+#ifdef HAVE_PTHREAD
+  sim_stop();
+  soft_stop();
+#endif
+  session_finish();
+  if (!headless) glutDestroyWindow(glc->window);
+  if (scene) scene_free(scene);
   free(glc);
 }
 
 static void ui_init(int *, char **);
+static int session_frame(void);
 
 int main(int argc, char **argv) {
+  snaketime now;
+
   glc = malloc(sizeof(struct glsnake_cfg));
   memset(glc, 0, sizeof(struct glsnake_cfg));
 
@@ -2357,16 +7590,47 @@ int main(int argc, char **argv) {
 
   ui_init(&argc, argv);
 
-  gettime(&glc->last_iteration);
-  memcpy(&glc->last_morph, &glc->last_iteration, sizeof(snaketime));
-  srand((unsigned int)GETSECS(glc->last_iteration));
+  /* a replay has the seed and the day from the session */
+  if (!session.in) {
+    gettime(&now);
+    session.seed = (unsigned long)GETSECS(now);
+    if (session.record) {
+      session.spooky = spooky();
+      session.latched = 1;
+    }
+  }
+  srand((unsigned int)session.seed);
+  srandom((unsigned int)session.seed);
+  if (soak || film.format) time_source = &virtual_time;
 
   glc->prev_colour = glc->next_colour =
       spooky() ? COLOUR_SPOOKY : COLOUR_ACYCLIC;
 
   glsnake_init();
+  session_start(argc, argv);
 
   atexit(unmain);
+  if (soak) {
+    soak_run();
+    return 0;
+  }
+  if (film.format) {
+    film_run();
+    return 0;
+  }
+  if (sheet.path) {
+    sheet_run();
+    return 0;
+  }
+  if (meshes.path) {
+    mesh_run();
+    return 0;
+  }
+  if (headless) {
+    while (session_frame())
+      ;
+    return 0;
+  }
   glutSwapBuffers();
   glutMainLoop();
 
@@ -2393,6 +7657,9 @@ static float mouse_start[3], mouse_end[3];
 /* dragging boolean */
 static int dragging = 0;
 
+/* the newest pointer position, and has the trackball yet to catch up? */
+static int motion_x, motion_y, motion_due;
+
 /* this function calculates the rotation matrix based on the quaternions
  * generated from the mouse drag vectors */
 static void calc_rotation() {
@@ -2432,21 +7699,75 @@ static void calc_rotation() {
 
 static void ui_mousedrag() { glMultMatrixf(rotation); }
 
-static void ui_keyboard(unsigned char c, int x ATTRIBUTE_UNUSED,
-                        int y ATTRIBUTE_UNUSED) {
+/* Keys that only change how things are drawn are handled here, on the UI
+ * thread.  The rest go to the simulation, see ui_key_command. */
+static void ui_keyboard(unsigned char c, int x, int y) {
+  session_put(SESSION_KEYBOARD, c, x, y, 0);
   switch (c) {
     case 27: /* ESC */
     case 'q':
       exit(0);
       break;
+    case 'w':
+      wireframe = 1 - wireframe;
+      gls_enable(GLS_LIGHTING, !wireframe);
+      glutPostRedisplay();
+      break;
+    case 'a':
+      transparent = 1 - transparent;
+      if (transparent) gls_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      gls_enable(GLS_BLEND, transparent);
+      glutPostRedisplay();
+      break;
+    case 'f':
+      glc->fullscreen = 1 - glc->fullscreen;
+      if (glc->fullscreen) {
+        glc->old_width = glc->width;
+        glc->old_height = glc->height;
+        glutFullScreen();
+      } else {
+        glutReshapeWindow(glc->old_width, glc->old_height);
+        glutPositionWindow(50, 50);
+      }
+      break;
+    case 't':
+      titles = 1 - titles;
+      glutPostRedisplay();
+      break;
+    case 'h':
+      hud = 1 - hud;
+      glutPostRedisplay();
+      break;
+    case 'z':
+      zoom += 1.0;
+      glsnake_reshape(glc->width, glc->height);
+      glutPostRedisplay();
+      break;
+    case 'Z':
+      zoom -= 1.0;
+      glsnake_reshape(glc->width, glc->height);
+      glutPostRedisplay();
+      break;
+#ifdef PROFILE
+    case 'P':
+      prof_dump();
+      break;
+#endif
+    default:
+      sim_post(c);
+      break;
+  }
+}
+
+/* act on a key that changes the simulation, on its thread */
+static void ui_key_command(int c) {
+  switch (c) {
     case 'e':
       explode += DEF_EXPLODE;
-      glutPostRedisplay();
       break;
     case 'E':
       explode -= DEF_EXPLODE;
       if (explode < 0.0) explode = 0.0;
-      glutPostRedisplay();
       break;
     case '.':
       /* next model */
@@ -2456,7 +7777,7 @@ static void ui_keyboard(unsigned char c, int x ATTRIBUTE_UNUSED,
       start_morph(glc->preset_index, 0);
 
       /* Reset last_morph time */
-      gettime(&glc->last_morph);
+      glc->morph_clock = 0;
       break;
     case ',':
       /* previous model */
@@ -2465,7 +7786,7 @@ static void ui_keyboard(unsigned char c, int x ATTRIBUTE_UNUSED,
       start_morph(glc->preset_index, 0);
 
       /* Reset glc->last_morph time */
-      gettime(&glc->last_morph);
+      glc->morph_clock = 0;
       break;
     case '+':
       angvel += DEF_ANGVEL;
@@ -2474,89 +7795,54 @@ static void ui_keyboard(unsigned char c, int x ATTRIBUTE_UNUSED,
       if (angvel > DEF_ANGVEL) angvel -= DEF_ANGVEL;
       break;
     case 'i':
-      if (interactive) {
-        /* Reset last_iteration and last_morph time */
-        gettime(&glc->last_iteration);
-        gettime(&glc->last_morph);
-      }
+      /* Reset last_morph time */
+      if (interactive) glc->morph_clock = 0;
       interactive = 1 - interactive;
-      glutPostRedisplay();
-      break;
-    case 'w':
-      wireframe = 1 - wireframe;
-      if (wireframe)
-        glDisable(GL_LIGHTING);
-      else
-        glEnable(GL_LIGHTING);
-      glutPostRedisplay();
-      break;
-    case 'a':
-      transparent = 1 - transparent;
-      if (transparent) {
-        glEnable(GL_BLEND);
-      } else {
-        glDisable(GL_BLEND);
-      }
       break;
     case 'p':
-      if (glc->paused) {
-        /* unpausing, reset last_iteration and last_morph time */
-        gettime(&glc->last_iteration);
-        gettime(&glc->last_morph);
-      }
+      /* unpausing, reset last_morph time */
+      if (glc->paused) glc->morph_clock = 0;
       glc->paused = 1 - glc->paused;
       break;
     case 'd':
       /* dump the current model so we can add it! */
       printf("# %s\nnoname:\t", glc->next_model_s.name);
       {
-        int i;
-        struct glsnake_shape *shape = &(glc->shape);
+        int i, square = 1;
+        struct glsnake_pose *shape = &(glc->shape);
+        struct glsnake_shape joints;
 
         for (i = 0; i < NODE_COUNT; i++) {
-          if (shape->node[i] == ZERO)
+          joints.node[i] = shape->node[i] >> ANGLE_SHIFT;
+          if (shape->node[i] == ZERO << ANGLE_SHIFT)
             printf("Z");
-          else if (shape->node[i] == LEFT)
+          else if (shape->node[i] == LEFT << ANGLE_SHIFT)
             printf("L");
-          else if (shape->node[i] == PIN)
+          else if (shape->node[i] == PIN << ANGLE_SHIFT)
             printf("P");
-          else if (shape->node[i] == RIGHT)
+          else if (shape->node[i] == RIGHT << ANGLE_SHIFT)
             printf("R");
+          else
+            square = 0;
           /*
             else
             printf("%f", node[i].curAngle);
           */
           if (i < NODE_COUNT - 1) printf(" ");
         }
-      }
-      printf("\n");
-      break;
-    case 'f':
-      glc->fullscreen = 1 - glc->fullscreen;
-      if (glc->fullscreen) {
-        glc->old_width = glc->width;
-        glc->old_height = glc->height;
-        glutFullScreen();
-      } else {
-        glutReshapeWindow(glc->old_width, glc->old_height);
-        glutPositionWindow(50, 50);
+        printf("\n");
+        /* and the mesh of it, once it has stopped between shapes */
+        if (meshes.dump) {
+          if (square)
+            mesh_dump(&joints);
+          else
+            fprintf(stderr, "glsnake: not meshing a snake in mid morph\n");
+        }
       }
       break;
-    case 't':
-      titles = 1 - titles;
-      if (interactive || glc->paused) glutPostRedisplay();
-      break;
     case 'c':
       altcolour = 1 - altcolour;
       break;
-    case 'z':
-      zoom += 1.0;
-      glsnake_reshape(glc->width, glc->height);
-      break;
-    case 'Z':
-      zoom -= 1.0;
-      glsnake_reshape(glc->width, glc->height);
-      break;
     case 'u': {
       int undo_idx = pop_undo_entry();
       if (undo_idx != -1) {
@@ -2570,10 +7856,31 @@ static void ui_keyboard(unsigned char c, int x ATTRIBUTE_UNUSED,
   }
 }
 
-static void ui_special(int key, int x ATTRIBUTE_UNUSED,
-                       int y ATTRIBUTE_UNUSED) {
-  float *destAngle = &(glc->next_model_s.shape.node[glc->selected]);
-  int unknown_key = 0;
+static void ui_special(int key, int x, int y) {
+  session_put(SESSION_SPECIAL, key, x, y, 0);
+  sim_post(SIM_SPECIAL | key);
+}
+
+/* Stop drawing, and stepping, while the window can't be seen.  Where GLUT
+ * can tell us the window is covered, treat that as hidden too. */
+static void ui_visibility(int state) {
+#ifdef GLUT_FULLY_COVERED
+  int hidden = state == GLUT_HIDDEN || state == GLUT_FULLY_COVERED;
+#else
+  int hidden = state == GLUT_NOT_VISIBLE;
+#endif
+
+  SIM_STORE(&sim.hidden, hidden);
+  sim_wake();
+  if (!hidden) {
+    glutIdleFunc(glsnake_idle);
+    glutPostRedisplay();
+  }
+}
+
+/* act on a special key, on the simulation thread */
+static void ui_special_command(int key) {
+  unsigned char *destAngle = &(glc->next_model_s.shape.node[glc->selected]);
 
   if (interactive) {
     switch (key) {
@@ -2585,30 +7892,28 @@ static void ui_special(int key, int x ATTRIBUTE_UNUSED,
         break;
       case GLUT_KEY_LEFT:
         save_snake_state();
-        *destAngle = fmod(*destAngle + (LEFT), 360);
+        *destAngle = (*destAngle + LEFT) % 4;
         glc->morphing = glc->new_morph = 1;
         break;
       case GLUT_KEY_RIGHT:
         save_snake_state();
-        *destAngle = fmod(*destAngle + (RIGHT), 360);
+        *destAngle = (*destAngle + RIGHT) % 4;
         glc->morphing = glc->new_morph = 1;
         break;
       case GLUT_KEY_HOME:
         save_snake_state();
-        start_morph(STRAIGHT_MODEL, 0);
+        start_morph_shape(&builtin_model[STRAIGHT_MODEL].shape, 0);
         break;
       default:
-        unknown_key = 1;
         break;
     }
   }
 
   calc_snake_metrics();
-
-  if (!unknown_key) glutPostRedisplay();
 }
 
 static inline void ui_mouse(int button, int state, int x, int y) {
+  session_put(SESSION_MOUSE, button, state, x, y);
   if (button == 0) {
     switch (state) {
       case GLUT_DOWN:
@@ -2621,6 +7926,7 @@ static inline void ui_mouse(int button, int state, int x, int y) {
                                             mouse_start[1] * mouse_start[1])));
         break;
       case GLUT_UP:
+        ui_drag();
         dragging = 0;
         oldquat[0] = cumquat[0];
         oldquat[1] = cumquat[1];
@@ -2634,62 +7940,269 @@ static inline void ui_mouse(int button, int state, int x, int y) {
   glutPostRedisplay();
 }
 
-static void ui_motion(int x, int y) {
+/* Turn the trackball to the newest pointer position, once a frame however
+ * many motion events came in since the last one. */
+static void ui_drag(void) {
   double norm;
   float q[4];
 
-  if (dragging) {
-    /* construct the motion end vector from the x,y position on the
-     * window */
-    mouse_end[0] = M_SQRT1_2 * (x - (glc->width / 2.0)) / (glc->width / 2.0);
-    mouse_end[1] = M_SQRT1_2 * ((glc->height / 2.0) - y) / (glc->height / 2.0);
-    /* calculate the normal of the vector... */
-    norm = mouse_end[0] * mouse_end[0] + mouse_end[1] * mouse_end[1];
-    /* check if norm is outside the sphere and wraparound if necessary */
-    if (norm > 1.0) {
-      mouse_end[0] = -mouse_end[0];
-      mouse_end[1] = -mouse_end[1];
-      mouse_end[2] = sqrt(norm - 1);
-    } else {
-      /* the z value comes from projecting onto an elliptical spheroid */
-      mouse_end[2] = sqrt(1 - norm);
-    }
+  if (!motion_due) return;
+  motion_due = 0;
+  if (!dragging) return;
+
+  /* construct the motion end vector from the x,y position on the
+   * window */
+  mouse_end[0] =
+      M_SQRT1_2 * (motion_x - (glc->width / 2.0)) / (glc->width / 2.0);
+  mouse_end[1] =
+      M_SQRT1_2 * ((glc->height / 2.0) - motion_y) / (glc->height / 2.0);
+  /* calculate the normal of the vector... */
+  norm = mouse_end[0] * mouse_end[0] + mouse_end[1] * mouse_end[1];
+  /* check if norm is outside the sphere and wraparound if necessary */
+  if (norm > 1.0) {
+    mouse_end[0] = -mouse_end[0];
+    mouse_end[1] = -mouse_end[1];
+    mouse_end[2] = sqrt(norm - 1);
+  } else {
+    /* the z value comes from projecting onto an elliptical spheroid */
+    mouse_end[2] = sqrt(1 - norm);
+  }
+
+  /* now here, build a quaternion from mouse_start and mouse_end */
+  q[0] = mouse_start[1] * mouse_end[2] - mouse_start[2] * mouse_end[1];
+  q[1] = mouse_start[2] * mouse_end[0] - mouse_start[0] * mouse_end[2];
+  q[2] = mouse_start[0] * mouse_end[1] - mouse_start[1] * mouse_end[0];
+  q[3] = mouse_start[0] * mouse_end[0] + mouse_start[1] * mouse_end[1] +
+         mouse_start[2] * mouse_end[2];
+
+  /* new rotation is the product of the new one and the old one */
+  cumquat[0] = q[3] * oldquat[0] + q[0] * oldquat[3] + q[1] * oldquat[2] -
+               q[2] * oldquat[1];
+  cumquat[1] = q[3] * oldquat[1] + q[1] * oldquat[3] + q[2] * oldquat[0] -
+               q[0] * oldquat[2];
+  cumquat[2] = q[3] * oldquat[2] + q[2] * oldquat[3] + q[0] * oldquat[1] -
+               q[1] * oldquat[0];
+  cumquat[3] = q[3] * oldquat[3] - q[0] * oldquat[0] - q[1] * oldquat[1] -
+               q[2] * oldquat[2];
+
+  calc_rotation();
+}
+
+/* just note where the pointer got to; ui_drag catches up when drawing */
+static void ui_motion(int x, int y) {
+  session_put(SESSION_MOTION, x, y, 0, 0);
+  motion_x = x;
+  motion_y = y;
+  if (motion_due) return;
+  motion_due = 1;
+  if (dragging) PROF_TRACE_DRAG();
+  glutPostRedisplay();
+}
 
-    /* now here, build a quaternion from mouse_start and mouse_end */
-    q[0] = mouse_start[1] * mouse_end[2] - mouse_start[2] * mouse_end[1];
-    q[1] = mouse_start[2] * mouse_end[0] - mouse_start[0] * mouse_end[2];
-    q[2] = mouse_start[0] * mouse_end[1] - mouse_start[1] * mouse_end[0];
-    q[3] = mouse_start[0] * mouse_end[0] + mouse_start[1] * mouse_end[1] +
-           mouse_start[2] * mouse_end[2];
+/* the window changed size; this is recorded, where zooming isn't */
+static void ui_reshape(int w, int h) {
+  session_put(SESSION_RESHAPE, w, h, 0, 0);
+  glsnake_reshape(w, h);
+}
 
-    /* new rotation is the product of the new one and the old one */
-    cumquat[0] = q[3] * oldquat[0] + q[0] * oldquat[3] + q[1] * oldquat[2] -
-                 q[2] * oldquat[1];
-    cumquat[1] = q[3] * oldquat[1] + q[1] * oldquat[3] + q[2] * oldquat[0] -
-                 q[0] * oldquat[2];
-    cumquat[2] = q[3] * oldquat[2] + q[2] * oldquat[3] + q[0] * oldquat[1] -
-                 q[1] * oldquat[0];
-    cumquat[3] = q[3] * oldquat[3] - q[0] * oldquat[0] - q[1] * oldquat[1] -
-                 q[2] * oldquat[2];
+/* Bring the simulation to where it was when a recorded frame was drawn,
+ * acting on each key after the same number of steps as it was, and show
+ * the same blend. */
+static void session_show(unsigned long steps, unsigned long keys, float t) {
+  for (;;) {
+    while (sim.keys < keys && session.tail != session.head &&
+           session.key_step[session.tail % SESSION_KEYS] == sim.steps)
+      sim_command(session.key[session.tail++ % SESSION_KEYS]);
+    if (sim.steps >= steps) break;
+    sim_step();
+  }
+  if (sim.steps != sim.state[sim.front].steps ||
+      sim.keys != sim.state[sim.front].keys)
+    sim_publish();
+  sim_take();
+  sim_blend(t);
+  sim.drawn = gettime_nsec();
+  session_shown();
+}
 
-    calc_rotation();
+/* Read the session up to its next frame, passing on the input to the UI
+ * on the way, and bring everything to that frame; returns 0 at the end.
+ * Without a window only the simulation matters, and input to the UI
+ * changes nothing there. */
+static int session_frame(void) {
+  unsigned long w[4];
+
+  for (;;) {
+    switch (session_get(w)) {
+      case SESSION_KEY:
+        if (session.head - session.tail == SESSION_KEYS) {
+          fprintf(stderr, "glsnake: too many keys in a frame in %s\n",
+                  session.replay);
+          return 0;
+        }
+        session.key_step[session.head % SESSION_KEYS] = w[0];
+        session.key[session.head++ % SESSION_KEYS] = w[1];
+        break;
+      case SESSION_FRAME:
+        session.recorded += w[3] * 1000LL;
+        session_show(w[0], w[1], session_float(w[2]));
+        return 1;
+      case SESSION_KEYBOARD:
+        /* the session ends on its own after the key that quit it */
+        if (!headless && w[0] != 'q' && w[0] != 27)
+          ui_keyboard(w[0], session_int(w[1]), session_int(w[2]));
+        break;
+      case SESSION_SPECIAL:
+        /* special keys only reach the simulation, as SESSION_KEYs */
+        break;
+      case SESSION_MOUSE:
+        if (!headless)
+          ui_mouse(session_int(w[0]), session_int(w[1]), session_int(w[2]),
+                   session_int(w[3]));
+        break;
+      case SESSION_MOTION:
+        if (!headless) ui_motion(session_int(w[0]), session_int(w[1]));
+        break;
+      case SESSION_RESHAPE:
+        glc->width = w[0];
+        glc->height = w[1];
+        if (!headless) glutReshapeWindow(w[0], w[1]);
+        break;
+      case SESSION_END:
+        session.ended = 1;
+        session.end_hash = w[1];
+        return 0;
+      default:
+        return 0;
+    }
   }
+}
+
+/* replaying in a window, draw each frame as soon as the last one is */
+static void session_idle(void) {
+  if (session.due) return;
+  if (!session_frame()) exit(0);
+  session.due = 1;
   glutPostRedisplay();
 }
 
+/* command line options, in the same spirit as the xscreensaver ones */
+#define OPT_FLAG 0
+#define OPT_INT 1
+#define OPT_STRING 2
+
+static struct ui_option {
+  const char *name;
+  int type;
+  void *var;
+  const char *help;
+} ui_options[] = {
+    {"snakes", OPT_INT, &snakes, "number of snakes to show at once"},
+    {"benchmark", OPT_FLAG, &benchmark, "report the frame rate on stderr"},
+    {"occlusion", OPT_FLAG, &occlusion,
+     "skip snakes hidden behind others in a scene"},
+    {"shaders", OPT_FLAG, &shaders,
+     "draw with GLSL shaders that pose the snake on the GPU"},
+    {"transparency", OPT_INT, &transparency,
+     "blend 0: along the chain, 1: sorted, 2: weighted (with shaders)"},
+    {"software", OPT_FLAG, &software,
+     "draw with the built in software renderer instead of GL"},
+    {"max-fps", OPT_INT, &maxfps, "draw at most n frames a second"},
+    {"hud", OPT_FLAG, &hud, "show the frame rate and how the snake is doing"},
+    {"record", OPT_STRING, &session.record, "record the session to a file"},
+    {"replay", OPT_STRING, &session.replay,
+     "replay a recorded session as fast as it will go"},
+    {"headless", OPT_FLAG, &headless,
+     "replay without a window, just the simulation"},
+    {"soak", OPT_INT, &soak,
+     "run n hours on a virtual clock, without a window, and report on it"},
+    {"export", OPT_STRING, &film.format,
+     "write frames to stdout as ppm, y4m or png, on a virtual clock"},
+    {"export-size", OPT_STRING, &film.size, "WxH of exported frames"},
+    {"export-frames", OPT_INT, &film.frames, "how many frames to export"},
+    {"models", OPT_STRING, &model_file, "take the models from a file"},
+    {"sheets", OPT_STRING, &sheet.path,
+     "draw every model on contact sheets, to files like sheet%03d.png"},
+    {"sheet-grid", OPT_STRING, &sheet.grid, "CxR models on each sheet"},
+    {"thumb-size", OPT_STRING, &sheet.thumb, "WxH of each model on a sheet"},
+    {"meshes", OPT_STRING, &meshes.path,
+     "write every model as a mesh, to files like snake%04d.stl, .obj or "
+     ".ply, or - for OBJ on stdout"},
+    {"mesh-merge", OPT_FLAG, &meshes.merge,
+     "join touching prisms up into one surface"},
+    {"dump-meshes", OPT_STRING, &meshes.dump,
+     "have the d key also write the shape as a mesh, to files like "
+     "dump%02d.stl, .obj or .ply"},
+};
+
+#define UI_OPTION_COUNT (sizeof(ui_options) / sizeof(ui_options[0]))
+
+static void ui_usage(const char *progname) {
+  size_t i;
+
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  for (i = 0; i < UI_OPTION_COUNT; i++)
+    fprintf(stderr, "  -%s%s\t%s\n", ui_options[i].name,
+            ui_options[i].type == OPT_FLAG  ? ""
+            : ui_options[i].type == OPT_INT ? " <n>"
+                                            : " <s>",
+            ui_options[i].help);
+  exit(1);
+}
+
+/* parse whatever glutInit has left of the command line */
+static void ui_parse_options(int argc, char **argv) {
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    const char *name = argv[i];
+    size_t o;
+
+    if (name[0] != '-') ui_usage(argv[0]);
+    /* allow --option as well as -option */
+    name += name[1] == '-' ? 2 : 1;
+
+    for (o = 0; o < UI_OPTION_COUNT; o++)
+      if (!strcmp(name, ui_options[o].name)) break;
+    if (o == UI_OPTION_COUNT) ui_usage(argv[0]);
+
+    switch (ui_options[o].type) {
+      case OPT_FLAG:
+        *(Bool *)ui_options[o].var = 1;
+        break;
+      case OPT_INT:
+        if (++i == argc) ui_usage(argv[0]);
+        *(int *)ui_options[o].var = atoi(argv[i]);
+        break;
+      case OPT_STRING:
+        if (++i == argc) ui_usage(argv[0]);
+        *(const char **)ui_options[o].var = argv[i];
+        break;
+    }
+  }
+
+  if (snakes < 1) snakes = 1;
+  if (transparency < TRANSPARENCY_CHAIN || transparency > TRANSPARENCY_WEIGHTED)
+    ui_usage(argv[0]);
+}
+
 static void ui_init(int *argc, char **argv) {
-  glutInit(argc, argv);
-  glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
-  glutInitWindowSize(glc->width, glc->height);
-  glc->window = glutCreateWindow("glsnake");
+  int i;
 
-  glutDisplayFunc(glsnake_display);
-  glutReshapeFunc(glsnake_reshape);
-  glutIdleFunc(glsnake_idle);
-  glutKeyboardFunc(ui_keyboard);
-  glutSpecialFunc(ui_special);
-  glutMouseFunc(ui_mouse);
-  glutMotionFunc(ui_motion);
+  /* without a window, there's no need for GLUT, or a display */
+  for (i = 1; i < *argc; i++) {
+    const char *name = argv[i] + (argv[i][0] == '-' && argv[i][1] == '-');
+
+    if (!strcmp(name, "-headless") || !strcmp(name, "-soak") ||
+        !strcmp(name, "-meshes"))
+      headless = 1;
+  }
+  if (!headless) {
+    glutInit(argc, argv);
+    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+    glutInitWindowSize(glc->width, glc->height);
+    glc->window = glutCreateWindow("glsnake");
+  }
 
   yangvel = DEF_YANGVEL;
   zangvel = DEF_ZANGVEL;
@@ -2702,7 +8215,90 @@ static void ui_init(int *argc, char **argv) {
   zoom = DEF_ZOOM;
   wireframe = DEF_WIREFRAME;
   transparent = DEF_TRANSPARENT;
+  snakes = DEF_SNAKES;
+  occlusion = DEF_OCCLUSION;
+  shaders = DEF_SHADERS;
+  transparency = DEF_TRANSPARENCY;
+  software = DEF_SOFTWARE;
+  maxfps = DEF_MAXFPS;
+  hud = DEF_HUD;
+  film.size = DEF_EXPORT_SIZE;
+  film.frames = DEF_EXPORT_FRAMES;
+  sheet.grid = DEF_SHEET_GRID;
+  sheet.thumb = DEF_THUMB_SIZE;
   undo_ring_start = 0;
   undo_ring_end = 0;
+
+  ui_parse_options(*argc, argv);
+
+  /* a replay takes the options it was recorded with, and then any given
+   * with it, but isn't recorded again */
+  if (session.replay) {
+    session_open();
+    ui_parse_options(session.argc, session.argv);
+    ui_parse_options(*argc, argv);
+    session.record = NULL;
+  }
+  if (model_file) model_load(model_file);
+  if (meshes.dump && (meshes.kind = film_pattern(meshes.dump)) < FILM_STL)
+    ui_usage(argv[0]);
+  /* which is a replay, a soak test or meshes, just one of them */
+  if (headless) {
+    if ((session.replay != NULL) + (soak > 0) + (meshes.path != NULL) != 1 ||
+        film.format || sheet.path)
+      ui_usage(argv[0]);
+    if (meshes.path) {
+      film.kind = strcmp(meshes.path, "-") ? film_pattern(meshes.path)
+                                           : FILM_OBJ;
+      if (film.kind < FILM_STL || session.record) ui_usage(argv[0]);
+    }
+    return;
+  }
+  /* an export draws into a framebuffer of its own, so the window that
+   * comes with the GL context is kept out of sight */
+  if (film.format) {
+    if (!strcmp(film.format, "ppm"))
+      film.kind = FILM_PPM;
+    else if (!strcmp(film.format, "y4m"))
+      film.kind = FILM_Y4M;
+    else if (!strcmp(film.format, "png"))
+      film.kind = FILM_PNG;
+    else
+      ui_usage(argv[0]);
+    if (sscanf(film.size, "%dx%d", &film.width, &film.height) != 2 ||
+        film.width < 1 || film.height < 1 || film.frames < 1 ||
+        session.replay || sheet.path)
+      ui_usage(argv[0]);
+    glutHideWindow();
+    return;
+  }
+  /* and so do contact sheets */
+  if (sheet.path) {
+    film.kind = film_pattern(sheet.path);
+    if ((film.kind != FILM_PNG && film.kind != FILM_PPM) ||
+        sscanf(sheet.grid, "%dx%d", &sheet.columns, &sheet.rows) != 2 ||
+        sscanf(sheet.thumb, "%dx%d", &sheet.width, &sheet.height) != 2 ||
+        sheet.columns < 1 || sheet.rows < 1 || sheet.width < 32 ||
+        sheet.height < 32 || session.replay || session.record)
+      ui_usage(argv[0]);
+    glutHideWindow();
+    return;
+  }
+
+  glutDisplayFunc(glsnake_display);
+  glutReshapeFunc(ui_reshape);
+  glutIdleFunc(glsnake_idle);
+  /* a replay's input comes from the session */
+  if (!session.in) {
+    glutKeyboardFunc(ui_keyboard);
+    glutSpecialFunc(ui_special);
+    glutMouseFunc(ui_mouse);
+    glutMotionFunc(ui_motion);
+  }
+#ifdef GLUT_FULLY_COVERED
+  glutWindowStatusFunc(ui_visibility);
+#else
+  glutVisibilityFunc(ui_visibility);
+#endif
 }
 #endif /* HAVE_GLUT */